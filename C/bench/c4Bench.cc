@@ -0,0 +1,424 @@
+//
+//  c4Bench.cc
+//  CBForest
+//
+//  Command-line benchmark exercising the C API end to end: bulk insertion, allDocs and changes
+//  enumeration, multi-threaded document reads, view indexing, and map / full-text / geo queries.
+//  Each phase reports throughput, median and 99th-percentile latency, and the number of bytes
+//  the phase added to the files.
+//
+//  Copyright © 2016 Couchbase. All rights reserved.
+//
+
+#include "c4Database.h"
+#include "c4Document.h"
+#include "c4DocEnumerator.h"
+#include "c4View.h"
+#include "c4Key.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+static unsigned sNumDocs         = 100000;
+static unsigned sBodySize        = 1000;
+static unsigned sBatchSize       = 1000;
+static unsigned sNumQueries      = 1000;
+static unsigned sNumReads        = 100000;
+static bool sConcurrentReads     = true;
+static std::string sDir          = "/tmp";
+
+
+#pragma mark - UTILITIES:
+
+
+static void fail(const char *what, C4Error error) {
+    C4SliceResult msg = c4error_getMessage(error);
+    fprintf(stderr, "FATAL: %s failed: %.*s (%d/%d)\n",
+            what, (int)msg.size, (const char*)msg.buf, error.domain, error.code);
+    c4slice_free(msg);
+    exit(1);
+}
+
+#define check(EXPR, WHAT)  do { if (!(EXPR)) fail(WHAT, error); } while (0)
+
+
+static uint64_t fileSize(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+}
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+// Collects per-operation latencies for one phase and prints a summary line.
+class Phase {
+public:
+    Phase(const char *name, std::vector<std::string> files)
+    :_name(name),
+     _files(files),
+     _startBytes(totalBytes()),
+     _start(Clock::now())
+    {
+        _latencies.reserve(sNumDocs);
+    }
+
+    void beginOp()      {_opStart = Clock::now();}
+    void endOp() {
+        auto elapsed = std::chrono::duration<double, std::micro>(Clock::now() - _opStart);
+        _latencies.push_back(elapsed.count());
+    }
+
+    // Adds latencies measured by another thread
+    void addLatencies(const std::vector<double> &latencies) {
+        _latencies.insert(_latencies.end(), latencies.begin(), latencies.end());
+    }
+
+    void report() {
+        double total = std::chrono::duration<double>(Clock::now() - _start).count();
+        size_t n = _latencies.size();
+        std::sort(_latencies.begin(), _latencies.end());
+        double p50 = n ? _latencies[n/2] : 0.0;
+        double p99 = n ? _latencies[std::min(n-1, (n*99)/100)] : 0.0;
+        uint64_t endBytes = totalBytes();
+        uint64_t written = (endBytes > _startBytes) ? endBytes - _startBytes : 0;
+        printf("%-18s %9zu ops  %12.0f ops/sec  p50 %9.2f us  p99 %9.2f us  %12llu bytes\n",
+               _name, n, (total > 0.0 ? n / total : 0.0), p50, p99,
+               (unsigned long long)written);
+        fflush(stdout);
+    }
+
+private:
+    uint64_t totalBytes() const {
+        uint64_t total = 0;
+        for (auto &file : _files)
+            total += fileSize(file);
+        return total;
+    }
+
+    const char* const _name;
+    const std::vector<std::string> _files;
+    const uint64_t _startBytes;
+    const Clock::time_point _start;
+    Clock::time_point _opStart;
+    std::vector<double> _latencies;
+};
+
+
+// Deterministic per-document pseudo-random numbers, so the indexer can regenerate the same
+// values from the docID without parsing the body.
+static uint32_t hashOf(uint32_t n) {
+    n = (n ^ 61) ^ (n >> 16);
+    n += (n << 3);
+    n ^= (n >> 4);
+    n *= 0x27d4eb2d;
+    n ^= (n >> 15);
+    return n;
+}
+
+static const char* const kWords[] = {
+    "apple", "bark", "cat", "dog", "elephant", "forest", "granite", "harbor", "island",
+    "jungle", "kettle", "lantern", "meadow", "nebula", "orchard", "pebble", "quarry", "river",
+    "summit", "thunder", "umbrella", "valley", "willow", "xylophone", "yonder", "zephyr"
+};
+static const unsigned kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+
+static std::string makeText(unsigned docNo, size_t size) {
+    std::string text;
+    text.reserve(size + 16);
+    uint32_t h = hashOf(docNo);
+    while (text.size() < size) {
+        if (!text.empty())
+            text += ' ';
+        text += kWords[h % kNumWords];
+        h = hashOf(h);
+    }
+    return text;
+}
+
+static C4GeoArea makeArea(unsigned docNo) {
+    uint32_t h = hashOf(docNo ^ 0x5bd1e995);
+    double lon = (h % 36000) / 100.0 - 180.0;
+    double lat = (hashOf(h) % 18000) / 100.0 - 90.0;
+    return {lon, lat, std::min(lon + 0.5, 180.0), std::min(lat + 0.5, 90.0)};
+}
+
+static unsigned docNoFromID(C4Slice docID) {
+    // docIDs are "doc-%08u"
+    return (unsigned)strtoul(std::string((const char*)docID.buf + 4, docID.size - 4).c_str(),
+                             NULL, 10);
+}
+
+
+#pragma mark - PHASES:
+
+
+static void benchInsert(C4Database *db, const std::string &dbPath) {
+    Phase phase("insert", {dbPath});
+    C4Error error;
+    char docID[20];
+    for (unsigned i = 0; i < sNumDocs; i += sBatchSize) {
+        check(c4db_beginTransaction(db, &error), "beginTransaction");
+        for (unsigned j = i; j < std::min(i + sBatchSize, sNumDocs); ++j) {
+            sprintf(docID, "doc-%08u", j);
+            std::string body = "{\"text\":\"" + makeText(j, sBodySize) + "\"}";
+
+            C4DocPutRequest rq = {};
+            rq.docID = c4str(docID);
+            rq.body = {body.data(), body.size()};
+            rq.save = true;
+            phase.beginOp();
+            C4Document *doc = c4doc_put(db, &rq, NULL, &error);
+            phase.endOp();
+            check(doc, "c4doc_put");
+            c4doc_free(doc);
+        }
+        check(c4db_endTransaction(db, true, &error), "endTransaction");
+    }
+    phase.report();
+}
+
+
+static void benchEnumerate(C4Database *db, const std::string &dbPath, bool byChanges) {
+    Phase phase(byChanges ? "changes" : "allDocs", {dbPath});
+    C4Error error;
+    C4EnumeratorOptions options = kC4DefaultEnumeratorOptions;
+    options.flags &= ~kC4IncludeBodies;
+    C4DocEnumerator *e = byChanges ? c4db_enumerateChanges(db, 0, &options, &error)
+                                   : c4db_enumerateAllDocs(db, kC4SliceNull, kC4SliceNull,
+                                                           &options, &error);
+    check(e, "enumerate");
+    C4DocumentInfo info;
+    while (true) {
+        phase.beginOp();
+        bool more = c4enum_next(e, &error) && c4enum_getDocumentInfo(e, &info);
+        if (!more)
+            break;
+        phase.endOp();
+    }
+    check(error.code == 0, "c4enum_next");
+    c4enum_free(e);
+    phase.report();
+}
+
+
+// Reads random documents from one shared C4Database on 1, 2, 4, 8 and 16 threads. Each round
+// does sNumReads reads in total, so ops/sec shows how well reads scale with threads.
+static void benchConcurrentReads(const std::string &dbPath) {
+    if (sNumDocs == 0)
+        return;
+    C4Error error;
+    C4DatabaseFlags flags = sConcurrentReads ? kC4DB_ConcurrentReads : 0;
+    C4Database *db = c4db_open(c4str(dbPath.c_str()), flags, NULL, &error);
+    check(db, "c4db_open");
+
+    for (unsigned nThreads = 1; nThreads <= 16; nThreads *= 2) {
+        char name[30];
+        sprintf(name, "reads/%u-threads", nThreads);
+        Phase phase(name, {dbPath});
+        std::vector<std::vector<double>> latencies(nThreads);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < nThreads; ++t) {
+            threads.emplace_back([=, &latencies]() {
+                C4Error error;
+                char docID[20];
+                auto &myLatencies = latencies[t];
+                for (unsigned i = t; i < sNumReads; i += nThreads) {
+                    sprintf(docID, "doc-%08u", hashOf(i) % sNumDocs);
+                    auto start = Clock::now();
+                    C4Document *doc = c4doc_get(db, c4str(docID), true, &error);
+                    check(doc, "c4doc_get");
+                    c4doc_free(doc);
+                    auto elapsed = std::chrono::duration<double, std::micro>(Clock::now()-start);
+                    myLatencies.push_back(elapsed.count());
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        for (auto &l : latencies)
+            phase.addLatencies(l);
+        phase.report();
+    }
+    check(c4db_free(db), "c4db_free");
+}
+
+
+enum ViewKind {kMapView, kFullTextView, kGeoView};
+
+
+static void benchIndex(C4Database *db, C4View *view, const std::string &viewPath,
+                       ViewKind kind, const char *name)
+{
+    Phase phase(name, {viewPath});
+    C4Error error;
+    C4Indexer *ind = c4indexer_begin(db, &view, 1, &error);
+    check(ind, "c4indexer_begin");
+    C4DocEnumerator *e = c4indexer_enumerateDocuments(ind, &error);
+    check(e, "c4indexer_enumerateDocuments");
+
+    C4Document *doc;
+    while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+        unsigned docNo = docNoFromID(doc->docID);
+        C4Key *keys[1];
+        C4Slice values[1];
+        switch (kind) {
+            case kMapView:
+                keys[0] = c4key_new();
+                c4key_addNumber(keys[0], hashOf(docNo) % sNumDocs);
+                break;
+            case kFullTextView: {
+                // Skip the {"text":" prefix and "} suffix of the JSON body:
+                C4Slice body = doc->selectedRev.body;
+                C4Slice text = {(const char*)body.buf + 9, body.size - 11};
+                keys[0] = c4key_newFullTextString(text, c4str("en"));
+                break;
+            }
+            case kGeoView:
+                keys[0] = c4key_newGeoJSON(c4str("{\"geo\":true}"), makeArea(docNo));
+                break;
+        }
+        values[0] = c4str("1234");
+        phase.beginOp();
+        bool ok = c4indexer_emit(ind, doc, 0, 1, keys, values, &error);
+        phase.endOp();
+        c4key_free(keys[0]);
+        c4doc_free(doc);
+        check(ok, "c4indexer_emit");
+    }
+    check(error.code == 0, "c4enum_nextDocument");
+    c4enum_free(e);
+    check(c4indexer_end(ind, true, &error), "c4indexer_end");
+    phase.report();
+}
+
+
+static void runQuery(Phase &phase, C4QueryEnumerator *e, C4Error &error) {
+    check(e, "query");
+    while (c4queryenum_next(e, &error))
+        ;
+    phase.endOp();
+    check(error.code == 0, "c4queryenum_next");
+    c4queryenum_free(e);
+}
+
+
+static void benchQuery(C4View *view, const std::string &viewPath,
+                       ViewKind kind, const char *name)
+{
+    Phase phase(name, {viewPath});
+    C4Error error;
+    for (unsigned q = 0; q < sNumQueries; ++q) {
+        uint32_t h = hashOf(q + 0x1234567);
+        switch (kind) {
+            case kMapView: {
+                C4QueryOptions options = kC4DefaultQueryOptions;
+                options.startKey = c4key_new();
+                c4key_addNumber(options.startKey, h % sNumDocs);
+                options.limit = 100;
+                phase.beginOp();
+                runQuery(phase, c4view_query(view, &options, &error), error);
+                c4key_free(options.startKey);
+                break;
+            }
+            case kFullTextView: {
+                char query[64];
+                sprintf(query, "%s %s", kWords[h % kNumWords], kWords[hashOf(h) % kNumWords]);
+                C4QueryOptions options = kC4DefaultQueryOptions;
+                options.limit = 100;
+                phase.beginOp();
+                runQuery(phase, c4view_fullTextQuery(view, c4str(query), kC4SliceNull,
+                                                     &options, &error), error);
+                break;
+            }
+            case kGeoView: {
+                C4GeoArea area = makeArea(q + 0x1234567);
+                area.xmax = std::min(area.xmin + 5.0, 180.0);
+                area.ymax = std::min(area.ymin + 5.0, 90.0);
+                phase.beginOp();
+                runQuery(phase, c4view_geoQuery(view, area, &error), error);
+                break;
+            }
+        }
+    }
+    phase.report();
+}
+
+
+#pragma mark - MAIN:
+
+
+static void usage() {
+    fprintf(stderr, "usage: cbforest_bench [--docs N] [--body-size BYTES] [--batch N] "
+                    "[--queries N] [--reads N] [--concurrent-reads 0|1] [--dir PATH]\n");
+    exit(2);
+}
+
+
+int main(int argc, const char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 >= argc)
+            usage();
+        const char *arg = argv[i], *val = argv[++i];
+        if (strcmp(arg, "--docs") == 0)
+            sNumDocs = (unsigned)atoi(val);
+        else if (strcmp(arg, "--body-size") == 0)
+            sBodySize = (unsigned)atoi(val);
+        else if (strcmp(arg, "--batch") == 0)
+            sBatchSize = std::max(1, atoi(val));
+        else if (strcmp(arg, "--queries") == 0)
+            sNumQueries = (unsigned)atoi(val);
+        else if (strcmp(arg, "--reads") == 0)
+            sNumReads = (unsigned)atoi(val);
+        else if (strcmp(arg, "--concurrent-reads") == 0)
+            sConcurrentReads = (atoi(val) != 0);
+        else if (strcmp(arg, "--dir") == 0)
+            sDir = val;
+        else
+            usage();
+    }
+
+    std::string dbPath = sDir + "/cbforest_bench.fdb";
+    const char* viewNames[3] = {"map", "fulltext", "geo"};
+    std::string viewPaths[3];
+    for (int v = 0; v < 3; ++v)
+        viewPaths[v] = sDir + "/cbforest_bench_" + viewNames[v] + ".fdb";
+
+    C4Error error;
+    c4db_deleteAtPath(c4str(dbPath.c_str()), kC4DB_Create, NULL);
+    C4Database *db = c4db_open(c4str(dbPath.c_str()), kC4DB_Create, NULL, &error);
+    check(db, "c4db_open");
+
+    printf("cbforest_bench: %u docs of ~%u bytes, %u per transaction, %u queries\n",
+           sNumDocs, sBodySize, sBatchSize, sNumQueries);
+
+    benchInsert(db, dbPath);
+    benchEnumerate(db, dbPath, false);
+    benchEnumerate(db, dbPath, true);
+    benchConcurrentReads(dbPath);
+
+    static const ViewKind kinds[3] = {kMapView, kFullTextView, kGeoView};
+    for (int v = 0; v < 3; ++v) {
+        c4view_deleteAtPath(c4str(viewPaths[v].c_str()), kC4DB_Create, NULL);
+        C4View *view = c4view_open(db, c4str(viewPaths[v].c_str()), c4str(viewNames[v]),
+                                   c4str("1"), kC4DB_Create, NULL, &error);
+        check(view, "c4view_open");
+        std::string indexName = std::string("index/") + viewNames[v];
+        std::string queryName = std::string("query/") + viewNames[v];
+        benchIndex(db, view, viewPaths[v], kinds[v], indexName.c_str());
+        benchQuery(view, viewPaths[v], kinds[v], queryName.c_str());
+        check(c4view_delete(view, &error), "c4view_delete");
+    }
+
+    check(c4db_delete(db, &error), "c4db_delete");
+    return 0;
+}
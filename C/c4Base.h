@@ -20,6 +20,12 @@
 #define __has_feature
 #define CBINLINE __forceinline
 #else
+#ifndef __has_extension
+#define __has_extension(x) 0    // GCC doesn't have these Clang built-ins
+#endif
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
 #define CBINLINE inline
 #endif
 
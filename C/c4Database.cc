@@ -22,6 +22,7 @@
 #include "DocEnumerator.hh"
 #include "LogInternal.hh"
 #include "VersionedDocument.hh"
+#include <algorithm>
 
 using namespace cbforest;
 
@@ -35,6 +36,9 @@ static const size_t kDBWALThreshold = 1024;
 // How often ForestDB should check whether databases need auto-compaction
 static const uint64_t kAutoCompactInterval = (5*60);
 
+// Name of the KeyStore holding conflicting revisions' bodies, with kC4DB_SeparateConflictBodies
+static const char* kConflictBodyStoreName = "conflictBodies";
+
 
 namespace c4Internal {
     std::atomic_int InstanceCounted::gObjectCount;
@@ -160,8 +164,114 @@ void c4log_register(C4LogLevel level, C4LogCallback callback) {
 
 
 c4Database::c4Database(std::string path, const config& cfg)
-:Database(path, cfg)
-{ }
+:Database(path, cfg),
+ _bodyCache(std::make_shared<RevisionBodyCache>())
+{
+    setOnCompact(onCompact, this);
+}
+
+c4Database::c4Database(c4Database *original, sequence snapshotSequence)
+:Database(original, snapshotSequence),
+ _bodyCache(snapshotSequence ? std::make_shared<RevisionBodyCache>() : original->_bodyCache)
+{
+    setOnCompact(onCompact, this);
+    // (A snapshot can't open the conflict body store; see Database::getKeyStore.)
+    setSeparateConflictBodies(original->_conflictBodyStore != NULL && snapshotSequence == 0);
+    setCompactRevTrees(original->_compactRevTrees);
+}
+
+c4Database::~c4Database() {
+    CBFAssert(_transactionLevel == 0);
+    closeReadHandles();
+}
+
+// Max number of read handles a database opens; calls wait for one to be returned beyond that.
+static const size_t kMaxReadHandles = 8;
+
+c4Database* c4Database::checkOutReadHandle() {
+#if C4DB_THREADSAFE
+    if (!_concurrentReads)
+        return this;
+    // The thread that owns the transaction holds _transactionMutex throughout; it has to read
+    // through this handle to see its own uncommitted changes. (try_lock on a recursive mutex
+    // only fails if another thread owns it.)
+    if (_transactionMutex.try_lock()) {
+        bool inTransaction = (_transactionLevel > 0);
+        _transactionMutex.unlock();
+        if (inTransaction)
+            return this;
+    }
+    std::unique_lock<std::mutex> lock(_readHandlesMutex);
+    _readHandleReturned.wait(lock, [this]{
+        return !_idleReadHandles.empty() || _readHandles.size() < kMaxReadHandles;
+    });
+    c4Database *reader;
+    if (_idleReadHandles.empty()) {
+        reader = new c4Database(this, 0);
+        _readHandles.push_back(reader);
+    } else {
+        reader = _idleReadHandles.back();
+        _idleReadHandles.pop_back();
+    }
+    return reader->retain();
+#else
+    return this;
+#endif
+}
+
+void c4Database::returnReadHandle(c4Database *reader) {
+#if C4DB_THREADSAFE
+    if (reader == this)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_readHandlesMutex);
+        // (If the pool was closed while the handle was checked out, it's not in it anymore.)
+        if (std::find(_readHandles.begin(), _readHandles.end(), reader) != _readHandles.end()) {
+            _idleReadHandles.push_back(reader);
+            _readHandleReturned.notify_one();
+        }
+    }
+    reader->release();
+#endif
+}
+
+// Compaction moves docs to new file offsets, invalidating the body cache.
+void c4Database::onCompact(void *context, bool compacting) {
+    auto db = (c4Database*)context;
+    db->_bodyCache->clear();
+    if (db->_clientOnCompact)
+        db->_clientOnCompact(db->_clientOnCompactContext, compacting);
+}
+
+void c4Database::setSeparateConflictBodies(bool separate) {
+    _conflictBodyStore = NULL;
+    if (separate) {
+        try {
+            _conflictBodyStore = &getKeyStore(kConflictBodyStoreName);
+        } catch (cbforest::error) {
+            // A read-only handle can't create the store; it just means there are no bodies in it.
+            if (!isReadOnly())
+                throw;
+        }
+    }
+}
+
+void c4Database::closeReadHandles() {
+#if C4DB_THREADSAFE
+    std::lock_guard<std::mutex> lock(_readHandlesMutex);
+    for (auto i = _readHandles.begin(); i != _readHandles.end(); ++i) {
+        c4Database *reader = *i;
+        {
+            WITH_LOCK(reader);
+            reader->close();
+        }
+        reader->release();      // C4Documents or enumerators may still retain it
+    }
+    _readHandles.clear();
+    _idleReadHandles.clear();
+    _readHandleReturned.notify_all();
+#endif
+}
 
 void c4Database::beginTransaction() {
 #if C4DB_THREADSAFE
@@ -200,17 +310,25 @@ bool c4Database::endTransaction(bool commit) {
 #endif
     if (_transactionLevel == 0)
         return false;
+    std::unique_ptr<Transaction> t;
+    bool abortedInside = false;
     if (--_transactionLevel == 0) {
-        WITH_LOCK(this);
-        auto t = _transaction;
+        t.reset(_transaction);
         _transaction = NULL;
+        // A nested call may have aborted the transaction, in which case it can't commit:
+        abortedInside = commit && t->state() == Transaction::kAbort;
         if (!commit)
             t->abort();
-        delete t; // this commits/aborts the transaction
     }
 #if C4DB_THREADSAFE
     _transactionMutex.unlock(); // undoes lock in beginTransaction()
 #endif
+    if (t) {
+        WITH_LOCK(this);
+        t->commit();    // commits or aborts the transaction; throws if the commit fails
+    }
+    if (abortedInside)
+        error::_throw(FDB_RESULT_TRANSACTION_FAIL);
     return true;
 }
 
@@ -255,7 +373,11 @@ C4Database* c4db_open(C4Slice path,
     auto config = c4DbConfig(flags, encryptionKey);
     try {
         try {
-            return new c4Database(pathStr, config);
+            auto db = new c4Database(pathStr, config);
+            db->setConcurrentReads((flags & kC4DB_ConcurrentReads) != 0);
+            db->setSeparateConflictBodies((flags & kC4DB_SeparateConflictBodies) != 0);
+            db->setCompactRevTrees((flags & kC4DB_CompactRevTrees) != 0);
+            return db;
         } catch (cbforest::error error) {
             if (error.status == FDB_RESULT_INVALID_COMPACTION_MODE
                         && config.compaction_mode == FDB_COMPACTION_AUTO) {
@@ -265,6 +387,9 @@ C4Database* c4db_open(C4Slice path,
                 config.compaction_mode = FDB_COMPACTION_MANUAL;
                 auto db = new c4Database(pathStr, config);
                 db->setCompactionMode(FDB_COMPACTION_AUTO);
+                db->setConcurrentReads((flags & kC4DB_ConcurrentReads) != 0);
+                db->setSeparateConflictBodies((flags & kC4DB_SeparateConflictBodies) != 0);
+                db->setCompactRevTrees((flags & kC4DB_CompactRevTrees) != 0);
                 return db;
             } else {
                 throw error;
@@ -275,6 +400,25 @@ C4Database* c4db_open(C4Slice path,
 }
 
 
+C4Database* c4db_openReadOnlyHandle(C4Database* database, C4Error *outError) {
+    try {
+        return new c4Database(database, 0);
+    } catchError(outError);
+    return NULL;
+}
+
+
+C4Database* c4db_openSnapshot(C4Database* database,
+                              C4SequenceNumber sequence,
+                              C4Error *outError)
+{
+    try {
+        return new c4Database(database, sequence ? sequence : FDB_SNAPSHOT_INMEM);
+    } catchError(outError);
+    return NULL;
+}
+
+
 bool c4db_close(C4Database* database, C4Error *outError) {
     if (database == NULL)
         return true;
@@ -282,6 +426,7 @@ bool c4db_close(C4Database* database, C4Error *outError) {
         return false;
     WITH_LOCK(database);
     try {
+        database->closeReadHandles();
         database->close();
         return true;
     } catchError(outError);
@@ -311,6 +456,7 @@ bool c4db_delete(C4Database* database, C4Error *outError) {
         if (database->refCount() > 1) {
             recordError(ForestDBDomain, FDB_RESULT_FILE_IS_BUSY, outError);
         }
+        database->closeReadHandles();
         database->deleteDatabase();
         return true;
     } catchError(outError);
@@ -346,7 +492,16 @@ bool c4db_isCompacting(C4Database *database) {
 
 void c4db_setOnCompactCallback(C4Database *database, C4OnCompactCallback cb, void *context) {
     WITH_LOCK(database);
-    database->setOnCompact(cb, context);
+    database->setClientOnCompact(cb, context);
+}
+
+
+void c4db_getBodyCacheStats(C4Database *database, uint64_t *outHits, uint64_t *outMisses) {
+    RevisionBodyCache *cache = database->bodyCache();
+    if (outHits)
+        *outHits = cache->hits();
+    if (outMisses)
+        *outMisses = cache->misses();
 }
 
 
@@ -382,6 +537,8 @@ C4SliceResult c4db_getPath(C4Database *database) {
 
 uint64_t c4db_getDocumentCount(C4Database* database) {
     try {
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         auto opts = DocEnumerator::Options::kDefault;
         opts.contentOptions = Database::kMetaOnly;
@@ -443,8 +600,12 @@ bool c4db_purgeDoc(C4Database *database, C4Slice docID, C4Error *outError) {
     if (!database->mustBeInTransaction(outError))
         return false;
     try {
-        if (database->transaction()->del(docID))
+        if (database->transaction()->del(docID)) {
+            if (database->conflictBodyStore())
+                VersionedDocument::purgeBodies(*database->conflictBodyStore(),
+                                               *database->transaction(), docID);
             return true;
+        }
         else
             recordError(ForestDBDomain, FDB_RESULT_KEY_NOT_FOUND, outError);
     } catchError(outError)
@@ -470,6 +631,8 @@ C4RawDocument* c4raw_get(C4Database* database,
                          C4Slice key,
                          C4Error *outError)
 {
+    ReadHandle readHandle(database);
+    database = readHandle;
     WITH_LOCK(database);
     try {
         KeyStore& localDocs = database->getKeyStore((std::string)storeName);
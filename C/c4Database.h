@@ -25,6 +25,10 @@ extern "C" {
         kC4DB_Create        = 1,    /**< Create the file if it doesn't exist */
         kC4DB_ReadOnly      = 2,    /**< Open file read-only */
         kC4DB_AutoCompact   = 4,    /**< Enable auto-compaction */
+        kC4DB_ConcurrentReads = 8,  /**< Outside a transaction, reads use pooled handles */
+        kC4DB_SeparateConflictBodies = 16, /**< Store conflicting revs' bodies outside the doc */
+        kC4DB_CompactRevTrees = 32, /**< Save revision trees in the compact (v2) format, which
+                                         also enables the fast path for saving a new revision */
     };
 
     /** Encryption algorithms. */
@@ -42,12 +46,45 @@ extern "C" {
     /** Opaque handle to an opened database. */
     typedef struct c4Database C4Database;
 
-    /** Opens a database. */
+    /** Opens a database.
+        If the kC4DB_ConcurrentReads flag is set (and CBForest is built with C4DB_THREADSAFE),
+        calls that only read -- getting documents, enumerating, counting, reading raw docs --
+        borrow one of a small pool of read-only handles for the duration of the call, so reads
+        on different threads don't block each other or the thread writing. Such reads see only
+        committed changes, except on the thread that has a transaction open. Documents read this
+        way, outside a transaction, can't be saved; get them again inside the transaction to
+        update them.
+        If the kC4DB_SeparateConflictBodies flag is set, saving a conflicted document moves the
+        bodies of its non-current leaf revisions into a separate store, so reading the document
+        only loads the current revision's body; the others are loaded on demand by
+        c4doc_loadRevisionBody. A database that has used this flag must always be opened with it,
+        or those bodies will be unavailable.
+        If the kC4DB_CompactRevTrees flag is set, documents are saved with their revision trees
+        in a smaller format that's faster to update: saving a new revision of such a document
+        reuses most of its saved tree, where without the flag the whole tree is re-encoded on
+        every save. Earlier versions of CBForest can't read documents saved this way, so don't
+        set it if the file may be opened by one. Documents in either format are always readable. */
     C4Database* c4db_open(C4Slice path,
                           C4DatabaseFlags flags,
                           const C4EncryptionKey *encryptionKey,
                           C4Error *outError);
 
+    /** Opens a new read-only handle on the same file as an open database. It has its own
+        ForestDB handle and its own lock, so a thread using it doesn't contend with threads using
+        the original (or other handles.) It sees the database's state as of each commit.
+        Free it with c4db_free when done. */
+    C4Database* c4db_openReadOnlyHandle(C4Database* database, C4Error *outError);
+
+    /** Opens a new read-only handle, like c4db_openReadOnlyHandle, whose contents are frozen as
+        of a commit: either the one that produced the given sequence, or the latest one if the
+        sequence is 0. Changes made to the database afterwards aren't visible through it.
+        Only documents can be read from a snapshot: raw documents (c4raw_get) can't, nor can
+        conflicting revisions' bodies stored separately (kC4DB_SeparateConflictBodies.)
+        Free it with c4db_free when done. */
+    C4Database* c4db_openSnapshot(C4Database* database,
+                                  C4SequenceNumber sequence,
+                                  C4Error *outError);
+
     /** Frees a database handle, closing the database first if it's still open. */
     bool c4db_free(C4Database* database);
 
@@ -76,6 +113,11 @@ extern "C" {
         careful of thread safety. */
     void c4db_setOnCompactCallback(C4Database *database, C4OnCompactCallback cb, void *context);
 
+    /** Gets the hit and miss counts of the database's cache of revision bodies that have to be
+        loaded from earlier versions of documents (by c4doc_loadRevisionBody.) The cache is
+        shared with read-only handles, and is cleared by compaction. Either pointer may be NULL. */
+    void c4db_getBodyCacheStats(C4Database *database, uint64_t *outHits, uint64_t *outMisses);
+
     /** Changes a database's encryption key (removing encryption if it's NULL.) */
     bool c4db_rekey(C4Database* database,
                     const C4EncryptionKey *newKey,
@@ -95,7 +137,7 @@ extern "C" {
     bool c4db_beginTransaction(C4Database* database,
                                C4Error *outError);
 
-    /** Commits or aborts a transaction. If there have been multiple calls to beginTransaction, it takes the same number of calls to endTransaction to actually end the transaction; only the last one commits or aborts the ForestDB transaction. */
+    /** Commits or aborts a transaction. If there have been multiple calls to beginTransaction, it takes the same number of calls to endTransaction to actually end the transaction; only the last one commits or aborts the ForestDB transaction. If a nested call (such as c4doc_putBatch) had to abort the transaction, committing it rolls back instead and fails with ForestDB's FDB_RESULT_TRANSACTION_FAIL. */
     bool c4db_endTransaction(C4Database* database,
                              bool commit,
                              C4Error *outError);
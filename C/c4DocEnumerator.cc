@@ -26,6 +26,10 @@
 using namespace cbforest;
 
 
+// Number of documents a kC4Prefetch enumerator reads ahead
+static const unsigned kPrefetchDepth = 64;
+
+
 #pragma mark - DOC ENUMERATION:
 
 CBFOREST_API const C4EnumeratorOptions kC4DefaultEnumeratorOptions = {
@@ -79,6 +83,8 @@ struct C4DocEnumerator: c4Internal::InstanceCounted {
         // (Remember, ForestDB's 'deleted' is what CBL calls 'purged')
         if ((c4options.flags & kC4IncludeBodies) == 0)
             options.contentOptions = KeyStore::kMetaOnly;
+        if (c4options.flags & kC4Prefetch)
+            options.prefetchDepth = kPrefetchDepth;
         return options;
     }
 
@@ -156,6 +162,8 @@ C4DocEnumerator* c4db_enumerateChanges(C4Database *database,
                                        C4Error *outError)
 {
     try {
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         return new C4DocEnumerator(database, since+1, UINT64_MAX,
                                    c4options ? *c4options : kC4DefaultEnumeratorOptions);
@@ -171,6 +179,8 @@ C4DocEnumerator* c4db_enumerateAllDocs(C4Database *database,
                                        C4Error *outError)
 {
     try {
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         return new C4DocEnumerator(database, startDocID, endDocID,
                                    c4options ? *c4options : kC4DefaultEnumeratorOptions);
@@ -189,6 +199,8 @@ C4DocEnumerator* c4db_enumerateSomeDocs(C4Database *database,
         std::vector<std::string> docIDStrings;
         for (size_t i = 0; i < docIDsCount; ++i)
             docIDStrings.push_back((std::string)docIDs[i]);
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         return new C4DocEnumerator(database, docIDStrings,
                                    c4options ? *c4options : kC4DefaultEnumeratorOptions);
@@ -24,11 +24,15 @@ extern "C" {
         kC4InclusiveEnd         = 0x04, /**< If false, iteration stops just _before_ endDocID. */
         kC4IncludeDeleted       = 0x08, /**< If true, include deleted documents. */
         kC4IncludeNonConflicted = 0x10, /**< If false, include _only_ documents in conflict. */
-        kC4IncludeBodies        = 0x20  /**< If false, document bodies will not be preloaded, just
+        kC4IncludeBodies        = 0x20, /**< If false, document bodies will not be preloaded, just
                                    metadata (docID, revID, sequence, flags.) This is faster if you
                                    don't need to access the revision tree or revision bodies. You
                                    can still access all the data of the document, but it will
                                    trigger loading the document body from the database. */
+        kC4Prefetch             = 0x40  /**< If true, documents are read ahead on a background
+                                   thread, overlapping I/O with the caller's processing. The
+                                   enumerator sees a snapshot of the database as of its creation.
+                                   Useful for long scans. */
     };
 
 
@@ -20,6 +20,7 @@
 
 #include "Database.hh"
 #include "Document.hh"
+#include "DocEnumerator.hh"
 #include "LogInternal.hh"
 #include "VersionedDocument.hh"
 #include "SecureRandomize.hh"
@@ -34,23 +35,21 @@ static const uint32_t kDefaultMaxRevTreeDepth = 20;
 struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
     C4Database* _db;
     VersionedDocument _versionedDoc;
-    const Revision *_selectedRev;
+    RevTree::RevHandle _selectedRev;    // stays valid across inserts, sorting and pruning
     alloc_slice _revIDBuf;
     alloc_slice _selectedRevIDBuf;
     alloc_slice _loadedBody;
 
     C4DocumentInternal(C4Database* database, C4Slice docID)
     :_db(database->retain()),
-     _versionedDoc(*_db, docID),
-     _selectedRev(NULL)
+     _versionedDoc(*_db, docID)
     {
         init();
     }
 
     C4DocumentInternal(C4Database *database, Document &&doc)
     :_db(database->retain()),
-    _versionedDoc(*_db, std::move(doc)),
-    _selectedRev(NULL)
+    _versionedDoc(*_db, std::move(doc))
     {
         init();
     }
@@ -60,6 +59,9 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
     }
 
     void init() {
+        _versionedDoc.setBodyStore(_db->conflictBodyStore());
+        _versionedDoc.setBodyCache(_db->bodyCache());
+        _versionedDoc.setEncodeV2(_db->compactRevTrees());
         docID = _versionedDoc.docID();
         flags = (C4DocumentFlags)_versionedDoc.flags();
         if (_versionedDoc.exists())
@@ -78,13 +80,17 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
         sequence = _versionedDoc.sequence();
     }
 
+    const Revision* selectedRevision() const {
+        return _versionedDoc.get(_selectedRev);
+    }
+
     bool selectRevision(const Revision *rev, C4Error *outError =NULL) {
-        _selectedRev = rev;
+        _selectedRev = _versionedDoc.handleOf(rev);
         _loadedBody = slice::null;
         if (rev) {
             _selectedRevIDBuf = rev->revID.expanded();
             selectedRev.revID = _selectedRevIDBuf;
-            selectedRev.flags = (C4RevisionFlags)rev->flags;
+            selectedRev.flags = (C4RevisionFlags)(rev->flags & ~Revision::kExternalBody);
             selectedRev.sequence = rev->sequence;
             selectedRev.body = rev->inlineBody();
             return true;
@@ -104,7 +110,7 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
             return selectRevision(_versionedDoc.currentRevision());
         } else {
             // Doc body (rev tree) isn't available, but we know enough about the current rev:
-            _selectedRev = NULL;
+            _selectedRev = RevTree::RevHandle();
             selectedRev.revID = revID;
             selectedRev.sequence = sequence;
             int revFlags = 0;
@@ -131,7 +137,7 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
         try {
             WITH_LOCK(_db);
             _versionedDoc.read();
-            _selectedRev = _versionedDoc.currentRevision();
+            _selectedRev = _versionedDoc.handleOf(_versionedDoc.currentRevision());
             return true;
         } catchError(outError)
         return false;
@@ -140,13 +146,14 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
     bool loadSelectedRevBody(C4Error *outError) {
         if (!loadRevisions(outError))
             return false;
-        if (!_selectedRev)
+        auto rev = selectedRevision();
+        if (!rev)
             return true;
         if (selectedRev.body.buf)
             return true;  // already loaded
         try {
             WITH_LOCK(_db);
-            _loadedBody = _selectedRev->readBody();
+            _loadedBody = rev->readBody();
             selectedRev.body = _loadedBody;
             if (_loadedBody.buf)
                 return true;
@@ -167,6 +174,10 @@ struct C4DocumentInternal : public C4Document, c4Internal::InstanceCounted {
 
     void save(unsigned maxRevTreeDepth) {
         _versionedDoc.prune(maxRevTreeDepth);
+        save();
+    }
+
+    void save() {
         {
             WITH_LOCK(_db);
             _versionedDoc.save(*_db->transaction());
@@ -204,6 +215,8 @@ C4Document* c4doc_get(C4Database *database,
                       C4Error *outError)
 {
     try {
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         auto doc = new C4DocumentInternal(database, docID);
         if (mustExist && !doc->_versionedDoc.exists()) {
@@ -222,6 +235,8 @@ C4Document* c4doc_getBySequence(C4Database *database,
                                 C4Error *outError)
 {
     try {
+        ReadHandle readHandle(database);
+        database = readHandle;
         WITH_LOCK(database);
         auto doc = new C4DocumentInternal(database, database->get(sequence));
         if (!doc->_versionedDoc.exists()) {
@@ -235,6 +250,43 @@ C4Document* c4doc_getBySequence(C4Database *database,
 }
 
 
+bool c4db_getDocuments(C4Database *database,
+                       const C4Slice docIDs[],
+                       size_t count,
+                       bool metaOnly,
+                       C4Document* outDocs[],
+                       C4Error *outError)
+{
+    try {
+        ReadHandle readHandle(database);
+        database = readHandle;
+        std::vector<slice> keys(docIDs, docIDs + count);
+        auto options = metaOnly ? KeyStore::kMetaOnly : KeyStore::kDefaultContent;
+        std::vector<Document> docs;
+        {
+            WITH_LOCK(database);
+            docs = database->get(keys, options);
+        }
+        // Creating the C4Documents doesn't need the lock since the Documents are in memory:
+        size_t i;
+        try {
+            for (i = 0; i < count; ++i) {
+                if (docs[i].exists())
+                    outDocs[i] = new C4DocumentInternal(database, std::move(docs[i]));
+                else
+                    outDocs[i] = NULL;
+            }
+        } catch (...) {
+            while (i-- > 0)
+                c4doc_free(outDocs[i]);
+            throw;
+        }
+        return true;
+    } catchError(outError);
+    return false;
+}
+
+
 #pragma mark - REVISIONS:
 
 
@@ -276,7 +328,8 @@ bool c4doc_hasRevisionBody(C4Document* doc) {
         if (!idoc->revisionsLoaded()) {
             Warn("c4doc_hasRevisionBody called on doc loaded without kC4IncludeBodies");
         }
-        return idoc->_selectedRev && idoc->_selectedRev->isBodyAvailable();
+        auto rev = idoc->selectedRevision();
+        return rev && rev->isBodyAvailable();
     } catchError(NULL);
     return false;
 }
@@ -287,9 +340,10 @@ bool c4doc_selectParentRevision(C4Document* doc) {
     if (!idoc->revisionsLoaded()) {
         Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
     }
-    if (idoc->_selectedRev)
-        idoc->selectRevision(idoc->_selectedRev->parent());
-    return idoc->_selectedRev != NULL;
+    auto rev = idoc->selectedRevision();
+    if (rev)
+        idoc->selectRevision(rev->parent());
+    return (bool)idoc->_selectedRev;
 }
 
 
@@ -298,9 +352,10 @@ bool c4doc_selectNextRevision(C4Document* doc) {
     if (!idoc->revisionsLoaded()) {
         Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
     }
-    if (idoc->_selectedRev)
-        idoc->selectRevision(idoc->_selectedRev->next());
-    return idoc->_selectedRev != NULL;
+    auto rev = idoc->selectedRevision();
+    if (rev)
+        idoc->selectRevision(rev->next());
+    return (bool)idoc->_selectedRev;
 }
 
 
@@ -313,7 +368,7 @@ bool c4doc_selectNextLeafRevision(C4Document* doc,
     if (!idoc->revisionsLoaded()) {
         Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
     }
-    auto rev = idoc->_selectedRev;
+    auto rev = idoc->selectedRevision();
     if (rev) {
         do {
             rev = rev->next();
@@ -353,14 +408,14 @@ static int32_t insertRevision(C4DocumentInternal *idoc,
                                                  body,
                                                  deletion,
                                                  hasAttachments,
-                                                 idoc->_selectedRev,
+                                                 idoc->selectedRevision(),
                                                  allowConflict,
                                                  httpStatus);
         if (newRev) {
-            // Success:
+            // Success. updateMeta() sorts the tree, so remember the new rev by handle:
+            auto newHandle = idoc->_versionedDoc.handleOf(newRev);
             idoc->updateMeta();
-            newRev = idoc->_versionedDoc.get(encodedRevID);
-            idoc->selectRevision(newRev);
+            idoc->selectRevision(idoc->_versionedDoc.get(newHandle));
             return 1;
         } else if (httpStatus == 200) {
             // Revision already exists, so nothing was added. Not an error.
@@ -415,13 +470,16 @@ int32_t c4doc_insertRevisionWithHistory(C4Document *doc,
         std::vector<revidBuffer> revIDBuffers(historyCount);
         for (size_t i = 0; i < historyCount; i++)
             revIDBuffers[i].parse(history[i]);
+        RevTree::RevHandle newHandle;
         commonAncestor = idoc->_versionedDoc.insertHistory(revIDBuffers,
                                                            body,
                                                            deleted,
-                                                           hasAttachments);
+                                                           hasAttachments,
+                                                           &newHandle);
         if (commonAncestor >= 0) {
+            // updateMeta() sorts the tree, so find the new rev again by its handle:
             idoc->updateMeta();
-            idoc->selectRevision(idoc->_versionedDoc[revidBuffer(history[0])]);
+            idoc->selectRevision(idoc->_versionedDoc.get(newHandle));
         } else {
             recordHTTPError(kC4HTTPBadRequest, outError); // must be invalid revision IDs
         }
@@ -575,7 +633,10 @@ C4Document* c4doc_getForPut(C4Database *database,
             if (!isNewDoc && !idoc->loadRevisions(outError))
                 break;
 
-            if (parentRevID.buf) {
+            if (parentRevID.buf && c4SliceEqual(parentRevID, idoc->revID)) {
+                // Updating the current revision, according to the doc's metadata. It's a leaf
+                // and init() already selected it, so there's no need to look it up in the tree.
+            } else if (parentRevID.buf) {
                 // Updating an existing revision; make sure it exists and is a leaf:
                 const Revision *rev = idoc->_versionedDoc[revidBuffer(parentRevID)];
                 if (!idoc->selectRevision(rev, outError))
@@ -592,18 +653,14 @@ C4Document* c4doc_getForPut(C4Database *database,
                                     outError );
                     break;
                 }
-                // If doc exists, current rev must be in a deleted state or there will be a conflict:
-                const Revision *rev = idoc->_versionedDoc.currentRevision();
-                if (rev) {
-                    if (!rev->isDeleted()) {
-                        recordHTTPError(kC4HTTPConflict, outError);
-                        break;
-                    }
-                    // New rev will be child of the tombstone:
-                    // (T0D0: Write a horror novel called "Child Of The Tombstone"!)
-                    if (!idoc->selectRevision(rev, outError))
-                        break;
+                // If doc exists, current rev must be in a deleted state or there will be a conflict.
+                // (The doc's metadata says so, and init() already selected that rev.)
+                if (idoc->_versionedDoc.exists() && !idoc->_versionedDoc.isDeleted()) {
+                    recordHTTPError(kC4HTTPConflict, outError);
+                    break;
                 }
+                // Else the new rev will be child of the tombstone, if any:
+                // (T0D0: Write a horror novel called "Child Of The Tombstone"!)
             }
             return idoc;
         } while (false); // not a real loop; it's just to allow 'break' statements to exit
@@ -666,3 +723,225 @@ C4Document* c4doc_put(C4Database *database,
         *outCommonAncestorIndex = inserted;
     return doc;
 }
+
+
+// Applies a run of existing-revision requests that all have the same docID, saving the doc once.
+static void putExistingRevisions(C4Database *database,
+                                 const C4DocPutRequest requests[],
+                                 std::vector<size_t>::const_iterator begin,
+                                 std::vector<size_t>::const_iterator end,
+                                 C4Error outErrors[])
+{
+    C4Error error;
+    C4Document *doc = c4doc_get(database, requests[*begin].docID, false, &error);
+    if (!doc) {
+        for (auto i = begin; i != end; ++i)
+            outErrors[*i] = error;
+        return;
+    }
+
+    bool changed = false;
+    uint32_t maxRevTreeDepth = 0;
+    for (auto i = begin; i != end; ++i) {
+        const C4DocPutRequest &rq = requests[*i];
+        if (rq.historyCount == 0) {
+            recordHTTPError(kC4HTTPBadRequest, &outErrors[*i]);
+            continue;
+        }
+        int32_t inserted = c4doc_insertRevisionWithHistory(doc, rq.body, rq.deletion,
+                                                           rq.hasAttachments, rq.history,
+                                                           rq.historyCount, &outErrors[*i]);
+        if (inserted >= 0) {
+            clearError(&outErrors[*i]);
+            changed = changed || (inserted > 0);
+            maxRevTreeDepth = std::max(maxRevTreeDepth, rq.maxRevTreeDepth);
+        }
+    }
+
+    if (changed && !c4doc_save(doc, maxRevTreeDepth, &error)) {
+        for (auto i = begin; i != end; ++i)
+            if (outErrors[*i].code == 0)
+                outErrors[*i] = error;
+    }
+    c4doc_free(doc);
+}
+
+
+bool c4doc_putBatch(C4Database *database,
+                    const C4DocPutRequest requests[],
+                    size_t count,
+                    C4Error outErrors[],
+                    C4Error *outError)
+{
+    // Sort existing-revision requests by docID, preserving the order of the ones for each doc:
+    std::vector<size_t> order;
+    order.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (requests[i].existingRevision && requests[i].docID.size == 0)
+            recordHTTPError(kC4HTTPBadRequest, &outErrors[i]);
+        else
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [requests](size_t a, size_t b) {
+        return requests[a].docID < requests[b].docID;
+    });
+
+    bool began = false;
+    try {
+        database->beginTransaction();
+        began = true;
+    } catchError(outError);
+    if (!began)
+        return false;
+
+    // A ForestDB error means the storage failed, not just the request, so the batch stops and the
+    // transaction is aborted (including the caller's, if it's nested in one):
+    C4Error storageError = {};
+    for (auto i = order.begin(); i != order.end(); ) {
+        const C4DocPutRequest &rq = requests[*i];
+        auto end = i + 1;
+        if (rq.existingRevision) {
+            while (end != order.end() && requests[*end].existingRevision
+                                      && requests[*end].docID == rq.docID)
+                ++end;
+            putExistingRevisions(database, requests, i, end, outErrors);
+        } else {
+            // New revisions can't be combined, since each depends on the result of the last:
+            C4DocPutRequest saveRq = rq;
+            saveRq.save = true;
+            C4Document *doc = c4doc_put(database, &saveRq, NULL, &outErrors[*i]);
+            if (doc) {
+                clearError(&outErrors[*i]);
+                c4doc_free(doc);
+            }
+        }
+        for (; i != end; ++i) {
+            if (outErrors[*i].code != 0 && outErrors[*i].domain == ForestDBDomain)
+                storageError = outErrors[*i];
+        }
+        if (storageError.code != 0) {
+            database->transaction()->abort();
+            break;
+        }
+    }
+
+    bool committed = false;
+    C4Error commitError = storageError;
+    try {
+        if (storageError.code == 0)
+            committed = database->endTransaction(true);
+        else
+            database->endTransaction(false);
+    } catchError(&commitError);
+    if (!committed) {
+        // Nothing was saved, so every request failed:
+        for (size_t i = 0; i < count; ++i)
+            if (outErrors[i].code == 0)
+                outErrors[i] = commitError;
+        if (outError)
+            *outError = commitError;
+    }
+    return committed;
+}
+
+
+#pragma mark - MAINTENANCE:
+
+
+static const uint64_t kDefaultPruneChunkBytes = 1024*1024;
+
+
+// Prunes and purges a doc's rev tree per the options, adding to the progress counts.
+// Returns true if the tree changed.
+static bool pruneDocument(C4DocumentInternal *idoc,
+                          const C4PruneOptions &options,
+                          C4PruneProgress &progress)
+{
+    auto &vdoc = idoc->_versionedDoc;
+    int purged = 0;
+    if (options.maxTombstoneAge > 0) {
+        auto current = vdoc.currentRevision();
+        unsigned currentGen = current->revID.generation();
+        // Collect the leaves first, since purging rearranges the tree:
+        std::vector<alloc_slice> oldLeaves;
+        auto leaves = vdoc.currentRevisions();
+        for (auto rev = leaves.begin(); rev != leaves.end(); ++rev) {
+            if (*rev != current && (*rev)->isDeleted()
+                    && (*rev)->revID.generation() + options.maxTombstoneAge <= currentGen)
+                oldLeaves.push_back(alloc_slice((*rev)->revID));
+        }
+        for (auto leaf = oldLeaves.begin(); leaf != oldLeaves.end(); ++leaf)
+            purged += vdoc.purge(revid(*leaf));
+    }
+    unsigned maxDepth = options.maxRevTreeDepth ? options.maxRevTreeDepth
+                                                : kDefaultMaxRevTreeDepth;
+    unsigned pruned = vdoc.prune(maxDepth);
+    progress.revsPurged += purged;
+    progress.revsPruned += pruned;
+    return purged > 0 || pruned > 0;
+}
+
+
+bool c4db_pruneRevisions(C4Database *database,
+                         const C4PruneOptions *options,
+                         C4PruneProgress *outProgress,
+                         C4Error *outError)
+{
+    if (outProgress->done)
+        return true;
+    uint64_t budget = options->maxBytesPerChunk ? options->maxBytesPerChunk
+                                                : kDefaultPruneChunkBytes;
+    bool began = false;
+    try {
+        database->beginTransaction();
+        began = true;
+    } catchError(outError);
+    if (!began)
+        return false;
+
+    // Work on a copy of the progress, so it's only updated if the transaction commits:
+    C4PruneProgress progress = *outProgress;
+    bool ok = false;
+    try {
+        if (progress.endSequence == 0)
+            progress.endSequence = c4db_getLastSequence(database);
+
+        // Read the next chunk of docs, up to the byte budget:
+        std::vector<Document> docs;
+        bool atEnd = true;
+        if (progress.lastSequence < progress.endSequence) {
+            WITH_LOCK(database);
+            DocEnumerator e(*database, progress.lastSequence + 1, progress.endSequence);
+            uint64_t bytesRead = 0;
+            while (!(atEnd = !e.next())) {
+                const Document &doc = e.doc();
+                bytesRead += doc.key().size + doc.meta().size + doc.body().size;
+                progress.lastSequence = doc.sequence();
+                docs.push_back(e.moveDoc());
+                if (bytesRead >= budget)
+                    break;
+            }
+        }
+
+        // Now shrink and save the ones that need it:
+        for (auto doc = docs.begin(); doc != docs.end(); ++doc) {
+            C4DocumentInternal idoc(database, std::move(*doc));
+            ++progress.docsExamined;
+            if (pruneDocument(&idoc, *options, progress)) {
+                idoc.save();
+                ++progress.docsRewritten;
+            }
+        }
+        progress.done = atEnd;
+        ok = true;
+    } catchError(outError);
+
+    bool committed = false;
+    try {
+        committed = database->endTransaction(ok);
+    } catchError(outError);
+    if (!ok || !committed)
+        return false;
+    *outProgress = progress;
+    return true;
+}
@@ -70,6 +70,25 @@ extern "C" {
                                     C4SequenceNumber,
                                     C4Error *outError);
 
+    /** Gets multiple documents from the database in one call. This is faster than calling
+        c4doc_get repeatedly: the database is locked once, and the docIDs are looked up in sorted
+        order. On success, outDocs[i] is set to the document whose ID is docIDs[i], or to NULL if
+        there's no such document. Each non-NULL document must be freed with c4doc_free.
+        @param database  The database.
+        @param docIDs  The document IDs to look up.
+        @param count  The number of items in docIDs[] and outDocs[].
+        @param metaOnly  If true, only the documents' metadata is read; their revisions will be
+                    loaded on demand, as with an enumerator that doesn't include bodies.
+        @param outDocs  An array of count pointers, which will be filled in with the documents.
+        @param outError  On failure, error info will be stored here.
+        @return  True on success, false on failure (in which case no documents are returned.) */
+    bool c4db_getDocuments(C4Database *database,
+                           const C4Slice docIDs[],
+                           size_t count,
+                           bool metaOnly,
+                           C4Document* outDocs[],
+                           C4Error *outError);
+
     /** Returns the document type (as set by setDocType.) This value is ignored by CBForest itself; by convention Couchbase Lite sets it to the value of the current revision's "type" property, and uses it as an optimization when indexing a view. */
     C4SliceResult c4doc_getType(C4Document *doc);
 
@@ -214,6 +233,75 @@ extern "C" {
                           size_t *outCommonAncestorIndex,
                           C4Error *outError);
 
+    /** Inserts a batch of revisions, typically ones pulled by a replicator. This is much faster than
+        calling c4doc_put for each one: requests are processed in docID order, and all requests
+        for the same document are applied to one in-memory copy of it, so each document is read
+        and saved only once. Everything is done in a single transaction, which this function
+        begins and ends itself (nesting inside the caller's, if there is one.)
+        Documents are always saved; the `save` field of the requests is ignored. For a document
+        receiving several requests, the largest maxRevTreeDepth among them is used.
+        @param database  The database.
+        @param requests  Array of put requests; see c4doc_put for their meanings.
+        @param count  The number of items in requests[] and outErrors[].
+        @param outErrors  An array of count C4Errors. Each is set to the result of the
+                    corresponding request: a code of 0 means it succeeded.
+        @param outError  On failure, error info will be stored here.
+        @return  True if the transaction committed; false if it failed, in which case none of the
+                    revisions were saved. A storage (ForestDBDomain) error in any request stops
+                    the batch and fails it; if the batch is nested in the caller's transaction,
+                    that transaction is aborted too. */
+    bool c4doc_putBatch(C4Database *database,
+                        const C4DocPutRequest requests[],
+                        size_t count,
+                        C4Error outErrors[],
+                        C4Error *outError);
+
+
+    //////// MAINTENANCE:
+
+
+    /** Parameters for c4db_pruneRevisions. */
+    typedef struct {
+        uint32_t maxRevTreeDepth;   ///< Prune rev trees deeper than this (or 0 for default)
+        uint32_t maxTombstoneAge;   ///< Purge deleted conflict branches whose leaf is at least
+                                    ///< this many generations older than the current revision
+                                    ///< (or 0 to keep them)
+        uint64_t maxBytesPerChunk;  ///< Max bytes of documents to read per call (or 0 for default)
+    } C4PruneOptions;
+
+    /** The state of a pruning job. Zero it before the first call to c4db_pruneRevisions, which
+        updates it after each chunk. It can be persisted and passed back later (even after the
+        database has been reopened) to resume the job where it left off. */
+    typedef struct {
+        C4SequenceNumber lastSequence;  ///< Last sequence examined so far
+        C4SequenceNumber endSequence;   ///< Database's last sequence when the job started
+        uint64_t docsExamined;          ///< Number of documents read
+        uint64_t docsRewritten;         ///< Number of documents saved with smaller trees
+        uint64_t revsPruned;            ///< Number of revisions removed for exceeding the depth
+        uint64_t revsPurged;            ///< Number of revisions removed with old tombstones
+        bool done;                      ///< Set when all documents have been examined
+    } C4PruneProgress;
+
+    /** Incrementally shrinks the revision trees of existing documents, for databases whose
+        documents were saved with a deep tree or aren't being updated anymore. Each call walks
+        the next chunk of documents in sequence order, reading at most about
+        options->maxBytesPerChunk bytes, and in a single transaction prunes each tree to
+        options->maxRevTreeDepth and purges old deleted branches. Only documents that changed
+        are saved (which gives them new sequences.) Documents created after the job started
+        aren't visited, since they're saved with the pruning depth already.
+        Call it repeatedly -- typically from a background thread, pausing between calls to
+        throttle the job -- until progress->done becomes true.
+        @param database  The database.
+        @param options  Pruning parameters.
+        @param progress  The state of the job, which is updated on success.
+        @param outError  On failure, error info will be stored here.
+        @return  True on success, false on failure (in which case progress is unchanged, and
+                    nothing in this chunk was saved.) */
+    bool c4db_pruneRevisions(C4Database *database,
+                             const C4PruneOptions *options,
+                             C4PruneProgress *progress,
+                             C4Error *outError);
+
     /** Generates the revision ID for a new document revision.
         @param body  The (JSON) body of the revision, exactly as it'll be stored.
         @param parentRevID  The revID of the parent revision, or null if there's none.
@@ -21,7 +21,9 @@
 // called c4db_beginTransaction, other threads making that call will block until the transaction
 // ends.
 #if C4DB_THREADSAFE
+#include <condition_variable>
 #include <mutex>
+#include <vector>
 #endif
 
 using namespace cbforest;
@@ -131,6 +133,7 @@ using namespace c4Internal;
 
 struct c4Database : public Database, RefCounted<c4Database> {
     c4Database(std::string path, const config& cfg);
+    c4Database(c4Database *original, sequence snapshotSequence);
     Transaction* transaction() {
         CBFAssert(_transaction);
         return _transaction;
@@ -143,20 +146,72 @@ struct c4Database : public Database, RefCounted<c4Database> {
     bool mustNotBeInTransaction(C4Error *outError);
     bool endTransaction(bool commit);
 
+    // With concurrent reads enabled (kC4DB_ConcurrentReads), read-only calls made outside a
+    // transaction check out one of a small pool of read-only handles, each with its own mutex,
+    // for the duration of the call. checkOutReadHandle() returns a retained pooled handle, or
+    // else this database; returnReadHandle() gives it back. (Use the ReadHandle class below.)
+    void setConcurrentReads(bool concurrent)    {_concurrentReads = concurrent;}
+    c4Database* checkOutReadHandle();
+    void returnReadHandle(c4Database*);
+    void closeReadHandles();
+
+    // With kC4DB_SeparateConflictBodies, the KeyStore holding the bodies of conflicting revs
+    // (see VersionedDocument::setBodyStore); else NULL.
+    void setSeparateConflictBodies(bool separate);
+    KeyStore* conflictBodyStore() const         {return _conflictBodyStore;}
+
+    // With kC4DB_CompactRevTrees, documents' rev trees are saved in the v2 format.
+    void setCompactRevTrees(bool compact)       {_compactRevTrees = compact;}
+    bool compactRevTrees() const                {return _compactRevTrees;}
+
+    // Cache of old revision bodies, shared with read handles (but not snapshots.) It's cleared
+    // when the database compacts, so the client's compaction callback is chained from ours.
+    RevisionBodyCache* bodyCache() const        {return _bodyCache.get();}
+    void setClientOnCompact(OnCompactCallback callback, void *context) {
+        _clientOnCompact = callback;
+        _clientOnCompactContext = context;
+    }
+
 #if C4DB_THREADSAFE
     // Mutex for synchronizing Database calls. Non-recursive!
     std::mutex _mutex;
 #endif
 
 private:
-    virtual ~c4Database() { CBFAssert(_transactionLevel == 0); }
+    virtual ~c4Database();
+    static void onCompact(void *context, bool compacting);
 #if C4DB_THREADSAFE
     // Recursive mutex for accessing _transaction and _transactionLevel.
     // Must be acquired BEFORE _mutex, or deadlock may occur!
     std::recursive_mutex _transactionMutex;
+    // Pool of read-only handles, used when _concurrentReads is set:
+    std::vector<c4Database*> _readHandles;          // every open read handle
+    std::vector<c4Database*> _idleReadHandles;      // the ones not checked out
+    std::mutex _readHandlesMutex;
+    std::condition_variable _readHandleReturned;
 #endif
     Transaction* _transaction {NULL};
     int _transactionLevel {0};
+    bool _concurrentReads {false};
+    bool _compactRevTrees {false};
+    KeyStore* _conflictBodyStore {NULL};
+    std::shared_ptr<RevisionBodyCache> _bodyCache;
+    OnCompactCallback _clientOnCompact {NULL};
+    void* _clientOnCompactContext {NULL};
+};
+
+
+// Checks out a c4Database's read handle for the current scope (see checkOutReadHandle.)
+// Documents and enumerators created through the handle retain it and go on using it, under its
+// own mutex, after it's returned to the pool.
+class ReadHandle {
+public:
+    ReadHandle(c4Database *db)      :_db(db), _handle(db->checkOutReadHandle()) { }
+    ~ReadHandle()                   {_db->returnReadHandle(_handle);}
+    operator c4Database*() const    {return _handle;}
+private:
+    c4Database* const _db;
+    c4Database* const _handle;
 };
 
 
@@ -25,6 +25,14 @@
 #include "Tokenizer.hh"
 #include <math.h>
 #include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 using namespace cbforest;
 
 
@@ -263,6 +271,7 @@ C4Indexer* c4indexer_begin(C4Database *db,
         indexer = new c4Indexer(db);
         for (size_t i = 0; i < viewCount; ++i)
             indexer->addView(views[i]);
+        indexer->setParallel(viewCount > 1);
         return indexer;
     } catchError(outError);
     if (indexer)
@@ -276,35 +285,47 @@ void c4indexer_triggerOnView(C4Indexer *indexer, C4View *view) {
 }
 
 
+// Creates an enumerator of the documents that need to be indexed. Documents that instead have
+// to be removed from every index are passed to onSkip rather than being returned.
+static C4DocEnumerator* enumerateDocsToIndex(c4Indexer *indexer,
+                                             std::function<void(const Document&)> onSkip,
+                                             C4Error *outError)
+{
+    auto docTypes = indexer->documentTypes();
+    sequence startSequence = indexer->startingSequence();
+    if (startSequence == UINT64_MAX) {
+        clearError(outError);      // end of iteration is not an error
+        return NULL;
+    }
+
+    auto options = kC4DefaultEnumeratorOptions;
+    options.flags |= kC4IncludeDeleted | kC4IncludePurged;
+    if (docTypes)
+        options.flags &= ~kC4IncludeBodies;
+    auto e = c4db_enumerateChanges(indexer->_db, startSequence-1, &options, outError);
+    if (!e)
+        return NULL;
+
+    setEnumFilter(e, [docTypes,onSkip](const Document &doc,
+                                       C4DocumentFlags flags,
+                                       slice docType) {
+        if ((flags & kExists) && !(flags & kDeleted)
+                              && (!docTypes || docTypes->count(docType) > 0))
+            return true;
+        // We're skipping this doc because it's either purged or deleted, or its docType
+        // doesn't match. But we do have to update the index to _remove_ it
+        onSkip(doc);
+        return false;
+    });
+    return e;
+}
+
+
 C4DocEnumerator* c4indexer_enumerateDocuments(C4Indexer *indexer, C4Error *outError) {
     try {
-        auto docTypes = indexer->documentTypes();
-        sequence startSequence = indexer->startingSequence();
-        if (startSequence == UINT64_MAX) {
-            clearError(outError);      // end of iteration is not an error
-            return NULL;
-        }
-
-        auto options = kC4DefaultEnumeratorOptions;
-        options.flags |= kC4IncludeDeleted | kC4IncludePurged;
-        if (docTypes)
-            options.flags &= ~kC4IncludeBodies;
-        auto e = c4db_enumerateChanges(indexer->_db, startSequence-1, &options, outError);
-        if (!e)
-            return NULL;
-
-        setEnumFilter(e, [docTypes,indexer](const Document &doc,
-                                            C4DocumentFlags flags,
-                                            slice docType) {
-            if ((flags & kExists) && !(flags & kDeleted)
-                                  && (!docTypes || docTypes->count(docType) > 0))
-                return true;
-            // We're skipping this doc because it's either purged or deleted, or its docType
-            // doesn't match. But we do have to update the index to _remove_ it
+        return enumerateDocsToIndex(indexer, [indexer](const Document &doc) {
             indexer->skipDoc(doc.key(), doc.sequence());
-            return false;
-        });
-        return e;
+        }, outError);
     } catchError(outError);
     return NULL;
 }
@@ -361,12 +382,275 @@ bool c4indexer_emitList(C4Indexer *indexer,
 }
 
 
+#pragma mark - PIPELINED INDEXING:
+
+
+namespace {
+
+    // One document passing through the indexing pipeline.
+    struct PipelineDoc {
+        enum ViewAction {
+            kIgnore,        // view has already indexed this doc
+            kRemove,        // doc's type doesn't match the view's; remove it from the index
+            kMap            // run the map function and emit the results
+        };
+
+        C4Document *doc {nullptr};              // NULL if the doc is removed from all views
+        alloc_slice docID;
+        sequence seq {0};
+        std::vector<ViewAction> actions;
+        std::vector<C4KeyValueList> emits;      // per view
+        bool mapped {false};
+
+        ~PipelineDoc()                          {c4doc_free(doc);}
+    };
+
+
+    // Runs indexing as three concurrent stages: a thread that reads the documents, a set of
+    // threads that call the map function, and the calling thread, which emits the results into
+    // the indexes in sequence order (as serial indexing would.)
+    class IndexPipeline {
+    public:
+        IndexPipeline(c4Indexer *indexer, unsigned mapThreads, C4MapFn mapFn, void *context)
+        :_indexer(indexer),
+         _mapFn(mapFn),
+         _context(context),
+         _mapThreads(std::max(mapThreads, 1u))
+        { }
+
+        bool run(C4Error *outError) {
+            // Create the enumerator here, since it reads the indexes' state:
+            C4Error c4err;
+            auto e = enumerateDocsToIndex(_indexer, [this](const Document &doc) {
+                auto item = std::make_shared<PipelineDoc>();
+                item->docID = doc.key();
+                item->seq = doc.sequence();
+                item->mapped = true;
+                push(item);
+            }, &c4err);
+            if (!e) {
+                if (c4err.code == 0) {
+                    clearError(outError);
+                    return true;        // nothing to index
+                }
+                if (outError)
+                    *outError = c4err;
+                return false;
+            }
+
+            // Every doc arrives in sequence order, so a doc needs to be mapped into a view iff
+            // its sequence is greater than what the view had indexed before we started:
+            for (unsigned v = 0; v < _indexer->viewCount(); ++v)
+                _startSequences.push_back(_indexer->lastSequenceIndexed(v));
+
+            std::vector<std::thread> threads;
+            threads.emplace_back([this, e]() {readDocs(e);});
+            for (unsigned i = 0; i < _mapThreads; ++i)
+                threads.emplace_back([this]() {mapDocs();});
+            applyDocs();
+            for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+                thread->join();
+            _window.clear();
+
+            if (_failed) {
+                if (outError)
+                    *outError = _error;
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        static const size_t kMaxWindow = 256;       // max # of docs in the pipeline at once
+
+        typedef std::shared_ptr<PipelineDoc> DocRef;
+        typedef std::unique_lock<std::mutex> lock_t;
+
+        void fail(C4Error c4err) {
+            lock_t lock(_mutex);
+            if (!_failed) {
+                _failed = true;
+                _error = c4err;
+            }
+            _cond.notify_all();
+        }
+
+        // Adds a doc to the end of the pipeline. Blocks while the pipeline is full.
+        bool push(DocRef item) {
+            lock_t lock(_mutex);
+            _cond.wait(lock, [&]{return _window.size() < kMaxWindow || _failed;});
+            if (_failed)
+                return false;
+            _window.push_back(item);
+            _cond.notify_all();
+            return true;
+        }
+
+        // Reader stage:
+        void readDocs(C4DocEnumerator *e) {
+            C4Error c4err = {};
+            bool ok = false;
+            try {
+                C4Document *doc;
+                while (!_failed && NULL != (doc = c4enum_nextDocument(e, &c4err))) {
+                    auto item = std::make_shared<PipelineDoc>();
+                    item->doc = doc;
+                    item->docID = doc->docID;
+                    item->seq = doc->sequence;
+                    item->mapped = true;
+                    slice docType = versionedDocument(doc).docType();
+                    for (unsigned v = 0; v < _startSequences.size(); ++v) {
+                        auto action = PipelineDoc::kIgnore;
+                        if (item->seq > _startSequences[v]) {
+                            if (_indexer->shouldMapDocTypeIntoView(docType, v)) {
+                                action = PipelineDoc::kMap;
+                                item->mapped = false;
+                            } else {
+                                action = PipelineDoc::kRemove;
+                            }
+                        }
+                        item->actions.push_back(action);
+                    }
+                    item->emits.resize(_startSequences.size());
+                    if (!push(item))
+                        break;
+                }
+                ok = (_failed || c4err.code == 0);
+            } catchError(&c4err)
+            c4enum_free(e);
+            if (!ok)
+                fail(c4err);
+
+            lock_t lock(_mutex);
+            _readingDone = true;
+            _cond.notify_all();
+        }
+
+        // Mapper stage:
+        void mapDocs() {
+            lock_t lock(_mutex);
+            for (;;) {
+                _cond.wait(lock, [&]{
+                    return _failed || _nextToMap < _window.size() || _readingDone;
+                });
+                if (_failed || _nextToMap >= _window.size())
+                    return;
+                DocRef item = _window[_nextToMap++];
+                if (item->mapped)
+                    continue;
+                lock.unlock();
+
+                C4Error c4err;
+                bool ok = true;
+                for (unsigned v = 0; ok && v < item->actions.size(); ++v) {
+                    if (item->actions[v] == PipelineDoc::kMap)
+                        ok = _mapFn(_context, item->doc, v, &item->emits[v], &c4err);
+                }
+
+                lock.lock();
+                if (!ok) {
+                    lock.unlock();
+                    fail(c4err);
+                    return;
+                }
+                item->mapped = true;
+                _cond.notify_all();
+            }
+        }
+
+        // Emitter stage, on the calling thread:
+        void applyDocs() {
+            lock_t lock(_mutex);
+            for (;;) {
+                _cond.wait(lock, [&]{
+                    return _failed || (!_window.empty() && _window.front()->mapped)
+                                   || (_window.empty() && _readingDone);
+                });
+                if (_failed || _window.empty())
+                    return;
+                DocRef item = _window.front();
+                _window.pop_front();
+                // The front doc may have been pre-mapped (skipped or deleted) and popped before
+                // any mapper got to it, in which case _nextToMap is already 0:
+                if (_nextToMap > 0)
+                    --_nextToMap;
+                _cond.notify_all();
+                lock.unlock();
+
+                C4Error c4err;
+                bool ok = false;
+                try {
+                    apply(*item);
+                    ok = true;
+                } catchError(&c4err)
+                if (!ok)
+                    fail(c4err);
+                lock.lock();
+            }
+        }
+
+        void apply(PipelineDoc &item) {
+            if (!item.doc) {
+                _indexer->skipDoc(item.docID, item.seq);
+                return;
+            }
+            for (unsigned v = 0; v < item.actions.size(); ++v) {
+                switch (item.actions[v]) {
+                    case PipelineDoc::kIgnore:
+                        break;
+                    case PipelineDoc::kRemove:
+                        _indexer->skipDocInView(item.docID, item.seq, v);
+                        break;
+                    case PipelineDoc::kMap:
+                        _indexer->emitDocIntoView(item.docID, item.seq, v,
+                                                  item.emits[v].keys, item.emits[v].values);
+                        break;
+                }
+            }
+        }
+
+        c4Indexer* const _indexer;
+        C4MapFn const _mapFn;
+        void* const _context;
+        unsigned const _mapThreads;
+        std::vector<sequence> _startSequences;
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<DocRef> _window;         // docs in the pipeline, in sequence order
+        size_t _nextToMap {0};              // index in _window of the next doc to map
+        bool _readingDone {false};
+        std::atomic<bool> _failed {false};
+        C4Error _error;
+    };
+
+}
+
+
+bool c4indexer_runPipelined(C4Indexer *indexer,
+                            unsigned mapThreads,
+                            C4MapFn mapFn,
+                            void *context,
+                            C4Error *outError)
+{
+    try {
+        IndexPipeline pipeline(indexer, mapThreads, mapFn, context);
+        return pipeline.run(outError);
+    } catchError(outError)
+    return false;
+}
+
+
 bool c4indexer_end(C4Indexer *indexer, bool commit, C4Error *outError) {
+    bool ok = false;
     try {
         if (commit)
             indexer->finished();
-        delete indexer;
-        return true;
+        ok = true;
+    } catchError(outError)
+    try {
+        delete indexer;     // aborts the index transactions if finished() wasn't successful
+        return ok;
     } catchError(outError)
     return false;
 }
@@ -156,6 +156,33 @@ extern "C" {
                             C4KeyValueList *kv,
                             C4Error *outError);
 
+    /** A map function callback used by c4indexer_runPipelined. It should compute the key/value
+        pairs that the document emits into the given view, adding them to `kv` with c4kv_add.
+        It's called on a background thread, possibly concurrently with other calls, so it must be
+        thread-safe. Return false (and store an error in outError) to abort indexing. */
+    typedef bool (*C4MapFn)(void *context,
+                            C4Document *doc,
+                            unsigned viewNumber,
+                            C4KeyValueList *kv,
+                            C4Error *outError);
+
+    /** Indexes all the documents that need it, as a pipeline: one thread reads the documents,
+        `mapThreads` threads call `mapFn` on them, and the calling thread adds the emitted rows to
+        the indexes in sequence order. This replaces the calls to
+        c4indexer_enumerateDocuments(), c4indexer_shouldIndexDocument() and c4indexer_emit();
+        afterwards call c4indexer_end() as usual.
+        @param indexer  The indexer task.
+        @param mapThreads  The number of threads to call mapFn on.
+        @param mapFn  The map function callback.
+        @param context  An arbitrary value passed to the callback.
+        @param outError  On failure, error info will be stored here.
+        @return  True on success (including if there was nothing to index), false on failure. */
+    bool c4indexer_runPipelined(C4Indexer *indexer,
+                                unsigned mapThreads,
+                                C4MapFn mapFn,
+                                void *context,
+                                C4Error *outError);
+
     /** Finishes an indexing task and frees the indexer reference.
         @param indexer  The indexer.
         @param commit  True to commit changes to the indexes, false to abort.
@@ -12,6 +12,9 @@
 #include "c4Test.hh"
 #include "forestdb.h"
 #include "c4Private.h"
+#include <atomic>
+#include <thread>
+#include <vector>
 #ifdef _MSC_VER
 #define random() rand()
 #endif
@@ -299,6 +302,103 @@ class C4DatabaseTest : public C4Test {
     }
 
 
+    void testLargeRevTree() {
+        // A history this long makes RevTree look up revIDs via its hash index:
+        const unsigned kHistoryCount = 50;
+        std::vector<std::string> revIDs;
+        for (unsigned i = kHistoryCount; i >= 1; i--) {
+            char buf[20];
+            sprintf(buf, "%u-%08lx", i, (unsigned long)random());
+            revIDs.push_back(buf);
+        }
+        C4Slice history[kHistoryCount];
+        for (unsigned i = 0; i < kHistoryCount; i++)
+            history[i] = c4str(revIDs[i].c_str());
+
+        C4Error error;
+        {
+            TransactionHelper t(db);
+            C4Document *doc = c4doc_get(db, kDocID, false, &error);
+            Assert(doc != NULL);
+            AssertEqual(c4doc_insertRevisionWithHistory(doc, kBody, false, false,
+                                                        history, kHistoryCount, &error),
+                        (int)kHistoryCount);
+            Assert(c4doc_save(doc, kHistoryCount, &error));
+            c4doc_free(doc);
+        }
+
+        C4Document *doc = c4doc_get(db, kDocID, true, &error);
+        Assert(doc != NULL);
+        for (unsigned i = 0; i < kHistoryCount; i++) {
+            Assert(c4doc_selectRevision(doc, history[i], false, &error));
+            AssertEqual(doc->selectedRev.revID, history[i]);
+        }
+        Assert(!c4doc_selectRevision(doc, C4STR("1-deadbeef"), false, &error));
+        c4doc_free(doc);
+    }
+
+    void testPruneRevisions() {
+        const unsigned kHistoryCount = 30;
+        std::vector<std::string> revIDs;
+        for (unsigned i = kHistoryCount; i >= 1; i--) {
+            char buf[20];
+            sprintf(buf, "%u-%08lx", i, (unsigned long)random());
+            revIDs.push_back(buf);
+        }
+        C4Slice history[kHistoryCount];
+        for (unsigned i = 0; i < kHistoryCount; i++)
+            history[i] = c4str(revIDs[i].c_str());
+
+        C4Error error;
+        {
+            TransactionHelper t(db);
+            C4Document *doc = c4doc_get(db, kDocID, false, &error);
+            Assert(doc != NULL);
+            AssertEqual(c4doc_insertRevisionWithHistory(doc, kBody, false, false,
+                                                        history, kHistoryCount, &error),
+                        (int)kHistoryCount);
+            // Add a deleted conflict branching off generation 5:
+            C4Slice conflict[2] = {C4STR("6-dead"), history[kHistoryCount - 5]};
+            AssertEqual(c4doc_insertRevisionWithHistory(doc, kC4SliceNull, true, false,
+                                                        conflict, 2, &error), 1);
+            Assert(c4doc_save(doc, 100, &error));
+            c4doc_free(doc);
+        }
+        createRev(C4STR("other"), kRevID, kBody);
+        C4SequenceNumber otherSeq = c4db_getLastSequence(db);
+
+        C4PruneOptions options = {};
+        options.maxRevTreeDepth = 10;
+        options.maxTombstoneAge = 20;
+        options.maxBytesPerChunk = 1;   // one doc per call
+        C4PruneProgress progress = {};
+        unsigned calls = 0;
+        while (!progress.done) {
+            Assert(c4db_pruneRevisions(db, &options, &progress, &error));
+            Assert(++calls <= 3);
+        }
+        AssertEqual(progress.endSequence, otherSeq);
+        AssertEqual(progress.docsExamined, (uint64_t)2);
+        AssertEqual(progress.docsRewritten, (uint64_t)1);
+        AssertEqual(progress.revsPurged, (uint64_t)1);
+        AssertEqual(progress.revsPruned, (uint64_t)20);
+
+        C4Document *doc = c4doc_get(db, kDocID, true, &error);
+        Assert(doc != NULL);
+        Assert(doc->sequence > otherSeq);
+        AssertEqual(doc->selectedRev.revID, history[0]);
+        unsigned depth = 1;
+        while (c4doc_selectParentRevision(doc))
+            ++depth;
+        AssertEqual(depth, 10u);
+        Assert(!c4doc_selectRevision(doc, C4STR("6-dead"), false, &error));
+        c4doc_free(doc);
+
+        // Running it again finds nothing to do:
+        Assert(c4db_pruneRevisions(db, &options, &progress, &error));
+        AssertEqual(progress.docsExamined, (uint64_t)2);
+    }
+
     void testPut() {
         C4Error error;
         TransactionHelper t(db);
@@ -358,6 +458,85 @@ class C4DatabaseTest : public C4Test {
     }
 
 
+    void testPutBatch() {
+        C4Slice historyA1[1] = {C4STR("1-aaaa")};
+        C4Slice historyA2[2] = {C4STR("2-aaaa"), C4STR("1-aaaa")};
+        C4Slice historyB1[1] = {C4STR("1-bbbb")};
+        C4DocPutRequest rqs[4] = {};
+        rqs[0].docID = C4STR("docA");
+        rqs[0].history = historyA1;
+        rqs[0].historyCount = 1;
+        rqs[1].docID = C4STR("docB");
+        rqs[1].history = historyB1;
+        rqs[1].historyCount = 1;
+        rqs[2].docID = C4STR("docA");
+        rqs[2].history = historyA2;
+        rqs[2].historyCount = 2;
+        rqs[3].docID = C4STR("docC");       // invalid: no history
+        for (int i = 0; i < 4; ++i) {
+            rqs[i].body = kBody;
+            rqs[i].existingRevision = true;
+        }
+
+        C4Error errors[4], error;
+        Assert(c4doc_putBatch(db, rqs, 4, errors, &error));
+        AssertEqual(errors[0].code, 0);
+        AssertEqual(errors[1].code, 0);
+        AssertEqual(errors[2].code, 0);
+        AssertEqual(errors[3].domain, HTTPDomain);
+        AssertEqual(errors[3].code, (int)kC4HTTPBadRequest);
+        Assert(!c4db_isInTransaction(db));
+
+        C4Document *doc = c4doc_get(db, C4STR("docA"), true, &error);
+        Assert(doc);
+        AssertEqual(doc->revID, C4STR("2-aaaa"));
+        AssertEqual(doc->flags, (C4DocumentFlags)kExists);
+        c4doc_free(doc);
+        doc = c4doc_get(db, C4STR("docB"), true, &error);
+        Assert(doc);
+        AssertEqual(doc->revID, C4STR("1-bbbb"));
+        c4doc_free(doc);
+        Assert(!c4doc_get(db, C4STR("docC"), true, &error));
+    }
+
+    void testPutBatchStorageError() {
+        // The middle request's docID is too long for ForestDB, so storing it fails:
+        std::string longDocID = "docAA" + std::string(100000, 'x');
+        C4Slice history[1] = {C4STR("1-aaaa")};
+        C4DocPutRequest rqs[3] = {};
+        rqs[0].docID = C4STR("docA");
+        rqs[1].docID = c4str(longDocID.c_str());
+        rqs[2].docID = C4STR("docB");
+        for (int i = 0; i < 3; ++i) {
+            rqs[i].body = kBody;
+            rqs[i].existingRevision = true;
+            rqs[i].history = history;
+            rqs[i].historyCount = 1;
+        }
+
+        // The whole batch fails, and nothing is saved:
+        C4Error errors[3], error;
+        Assert(!c4doc_putBatch(db, rqs, 3, errors, &error));
+        AssertEqual(error.domain, ForestDBDomain);
+        for (int i = 0; i < 3; ++i)
+            AssertEqual(errors[i].domain, ForestDBDomain);
+        Assert(!c4db_isInTransaction(db));
+        Assert(!c4doc_get(db, C4STR("docA"), true, &error));
+        Assert(!c4doc_get(db, C4STR("docB"), true, &error));
+
+        // Nested in the caller's transaction, it aborts that too, so committing it fails:
+        Assert(c4db_beginTransaction(db, &error));
+        createRev(C4STR("docC"), kRevID, kBody);
+        Assert(!c4doc_putBatch(db, rqs, 3, errors, &error));
+        Assert(!c4db_endTransaction(db, true, &error));
+        AssertEqual(error.domain, ForestDBDomain);
+        AssertEqual(error.code, (int)FDB_RESULT_TRANSACTION_FAIL);
+        Assert(!c4db_isInTransaction(db));
+        Assert(!c4doc_get(db, C4STR("docA"), true, &error));
+        Assert(!c4doc_get(db, C4STR("docC"), true, &error));
+    }
+
+
     void testAllDocs() {
         setupAllDocs();
         C4Error error;
@@ -431,6 +610,250 @@ class C4DatabaseTest : public C4Test {
     }
 
 
+    void testAllDocsPrefetch() {
+        setupAllDocs();
+        C4Error error;
+        C4EnumeratorOptions options = kC4DefaultEnumeratorOptions;
+        options.flags |= kC4Prefetch;
+        options.skip = 2;
+        C4DocEnumerator* e = c4db_enumerateAllDocs(db, kC4SliceNull, kC4SliceNull,
+                                                   &options, &error);
+        Assert(e);
+        char docID[20];
+        int i = 3;
+        while (c4enum_next(e, &error)) {
+            auto doc = c4enum_getDocument(e, &error);
+            Assert(doc);
+            sprintf(docID, "doc-%03d", i);
+            AssertEqual(doc->docID, c4str(docID));
+            AssertEqual(doc->selectedRev.body, kBody);
+            c4doc_free(doc);
+            i++;
+        }
+        AssertEqual(error.code, 0);
+        c4enum_free(e);
+        AssertEqual(i, 100);
+
+        // Closing before the end should stop the prefetcher:
+        e = c4db_enumerateAllDocs(db, kC4SliceNull, kC4SliceNull, &options, &error);
+        Assert(e);
+        Assert(c4enum_next(e, &error));
+        c4enum_close(e);
+        Assert(!c4enum_next(e, &error));
+        c4enum_free(e);
+    }
+
+
+    void testGetDocuments() {
+        setupAllDocs();
+        C4Error error;
+        C4Slice docIDs[4] = {C4STR("doc-042"), C4STR("doc-007"), C4STR("bogus"), C4STR("doc-001")};
+        C4Document* docs[4];
+        for (int metaOnly = 0; metaOnly <= 1; ++metaOnly) {
+            Assert(c4db_getDocuments(db, docIDs, 4, metaOnly, docs, &error));
+            for (int i = 0; i < 4; ++i) {
+                if (i == 2) {
+                    Assert(docs[i] == NULL);
+                    continue;
+                }
+                Assert(docs[i]);
+                AssertEqual(docs[i]->docID, docIDs[i]);
+                AssertEqual(docs[i]->revID, kRevID);
+                AssertEqual(docs[i]->selectedRev.body, metaOnly ? kC4SliceNull : kBody);
+                Assert(c4doc_loadRevisionBody(docs[i], &error));
+                AssertEqual(docs[i]->selectedRev.body, kBody);
+                c4doc_free(docs[i]);
+            }
+        }
+    }
+
+
+    void testSnapshot() {
+        createRev(C4STR("doc-1"), kRevID, kBody);
+        C4Error error;
+        Assert(c4db_beginTransaction(db, &error));
+        Assert(c4raw_put(db, c4str("test"), c4str("key"), kC4SliceNull, kBody, &error));
+        Assert(c4db_endTransaction(db, true, &error));
+        C4Database *snapshot = c4db_openSnapshot(db, 0, &error);
+        Assert(snapshot);
+        C4Database *reader = c4db_openReadOnlyHandle(db, &error);
+        Assert(reader);
+
+        createRev(C4STR("doc-2"), kRevID, kBody);
+
+        // The snapshot doesn't see the new doc, but the read-only handle does:
+        AssertEqual(c4db_getLastSequence(snapshot), (C4SequenceNumber)1);
+        AssertEqual(c4db_getLastSequence(reader), (C4SequenceNumber)2);
+        C4Document *doc = c4doc_get(snapshot, C4STR("doc-1"), true, &error);
+        Assert(doc);
+        c4doc_free(doc);
+        Assert(!c4doc_get(snapshot, C4STR("doc-2"), true, &error));
+        doc = c4doc_get(reader, C4STR("doc-2"), true, &error);
+        Assert(doc);
+        c4doc_free(doc);
+
+        // Other key-stores can't be frozen, so the snapshot refuses to read them:
+        Assert(!c4raw_get(snapshot, c4str("test"), c4str("key"), &error));
+        AssertEqual(error.domain, ForestDBDomain);
+        C4RawDocument *rawDoc = c4raw_get(reader, c4str("test"), c4str("key"), &error);
+        Assert(rawDoc);
+        c4raw_free(rawDoc);
+
+        Assert(c4db_free(snapshot));
+        Assert(c4db_free(reader));
+    }
+
+
+    void testConcurrentReads() {
+        createRev(C4STR("doc-1"), kRevID, kBody);
+        C4Error error;
+        int objectCount = c4_getObjectCount();
+        C4SliceResult path = c4db_getPath(db);
+        C4Database *db2 = c4db_open({path.buf, path.size}, kC4DB_ConcurrentReads,
+                                    encryptionKey(), &error);
+        c4slice_free(path);
+        Assert(db2);
+
+        // Several rounds of short-lived threads:
+        std::atomic_int found {0};
+        for (int round = 0; round < 4; ++round) {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 16; ++t) {
+                threads.emplace_back([db2, &found]() {
+                    C4Error error;
+                    for (int i = 0; i < 25; ++i) {
+                        C4Document *doc = c4doc_get(db2, C4STR("doc-1"), true, &error);
+                        if (doc)
+                            ++found;
+                        c4doc_free(doc);
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+        }
+        AssertEqual((int)found, 1600);
+        // The read handles are pooled (at most 8), not opened per thread:
+        Assert(c4_getObjectCount() - objectCount <= 1 + 8);
+
+        // Inside a transaction, reads see the transaction's uncommitted changes:
+        Assert(c4db_beginTransaction(db2, &error));
+        C4Document *doc = c4doc_get(db2, C4STR("doc-2"), false, &error);
+        Assert(doc);
+        Assert(c4doc_insertRevision(doc, kRevID, kBody, false, false, false, &error));
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+        doc = c4doc_get(db2, C4STR("doc-2"), true, &error);
+        Assert(doc);
+        c4doc_free(doc);
+        Assert(c4db_endTransaction(db2, true, &error));
+
+        Assert(c4db_free(db2));
+    }
+
+
+    void testSeparateConflictBodies() {
+        C4Error error;
+        C4SliceResult path = c4db_getPath(db);
+        C4Database *db2 = c4db_open({path.buf, path.size}, kC4DB_SeparateConflictBodies,
+                                    encryptionKey(), &error);
+        c4slice_free(path);
+        Assert(db2);
+
+        const C4Slice kLoserBody = C4STR("{\"loser\":true}");
+        const C4Slice kWinnerBody = C4STR("{\"winner\":true}");
+        Assert(c4db_beginTransaction(db2, &error));
+        C4Document *doc = c4doc_get(db2, kDocID, false, &error);
+        Assert(doc);
+        C4Slice history1[2] = {C4STR("2-aaaa"), kRevID};
+        AssertEqual(c4doc_insertRevisionWithHistory(doc, kLoserBody, false, false,
+                                                    history1, 2, &error), 2);
+        C4Slice history2[2] = {C4STR("2-bbbb"), kRevID};
+        AssertEqual(c4doc_insertRevisionWithHistory(doc, kWinnerBody, false, false,
+                                                    history2, 2, &error), 1);
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+        Assert(c4db_endTransaction(db2, true, &error));
+
+        // Only the current revision's body is in the document; the other loads on demand:
+        doc = c4doc_get(db2, kDocID, true, &error);
+        Assert(doc);
+        AssertEqual(doc->selectedRev.body, kWinnerBody);
+        Assert(c4doc_selectRevision(doc, C4STR("2-aaaa"), false, &error));
+        AssertEqual(doc->selectedRev.body, kC4SliceNull);
+        Assert(c4doc_hasRevisionBody(doc));
+        Assert(c4doc_loadRevisionBody(doc, &error));
+        AssertEqual(doc->selectedRev.body, kLoserBody);
+
+        // Purging the winner makes the loser current, and brings its body back inline:
+        Assert(c4db_beginTransaction(db2, &error));
+        AssertEqual(c4doc_purgeRevision(doc, C4STR("2-bbbb"), &error), 1);
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+        Assert(c4db_endTransaction(db2, true, &error));
+        doc = c4doc_get(db2, kDocID, true, &error);
+        Assert(doc);
+        AssertEqual(doc->selectedRev.revID, C4STR("2-aaaa"));
+        AssertEqual(doc->selectedRev.body, kLoserBody);
+        c4doc_free(doc);
+
+        // A conflicting rev's body stays available after the rev gets a child, like any other
+        // ancestor's:
+        const C4Slice kDoc2ID = C4STR("doc2");
+        Assert(c4db_beginTransaction(db2, &error));
+        doc = c4doc_get(db2, kDoc2ID, false, &error);
+        Assert(doc);
+        AssertEqual(c4doc_insertRevisionWithHistory(doc, kLoserBody, false, false,
+                                                    history1, 2, &error), 2);
+        AssertEqual(c4doc_insertRevisionWithHistory(doc, kWinnerBody, false, false,
+                                                    history2, 2, &error), 1);
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+        Assert(c4db_endTransaction(db2, true, &error));
+
+        Assert(c4db_beginTransaction(db2, &error));
+        doc = c4doc_get(db2, kDoc2ID, true, &error);
+        Assert(doc);
+        C4Slice history3[2] = {C4STR("3-aaaa"), C4STR("2-aaaa")};
+        AssertEqual(c4doc_insertRevisionWithHistory(doc, kBody, false, false,
+                                                    history3, 2, &error), 1);
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+        Assert(c4db_endTransaction(db2, true, &error));
+
+        doc = c4doc_get(db2, kDoc2ID, true, &error);
+        Assert(doc);
+        AssertEqual(doc->selectedRev.revID, C4STR("3-aaaa"));
+        Assert(c4doc_selectRevision(doc, C4STR("2-aaaa"), false, &error));
+        Assert(c4doc_hasRevisionBody(doc));
+        Assert(c4doc_loadRevisionBody(doc, &error));
+        AssertEqual(doc->selectedRev.body, kLoserBody);
+        c4doc_free(doc);
+
+        Assert(c4db_free(db2));
+    }
+
+
+    void testBodyCache() {
+        // After rev 2 is saved, rev 1's body is only in the previous version of the doc:
+        createRev(kDocID, kRevID, kBody);
+        createRev(kDocID, kRev2ID, C4STR("{\"ok\":\"go\"}"));
+
+        uint64_t hits, misses;
+        for (int i = 0; i < 2; ++i) {
+            C4Error error;
+            C4Document *doc = c4doc_get(db, kDocID, true, &error);
+            Assert(doc);
+            Assert(c4doc_selectRevision(doc, kRevID, true, &error));
+            AssertEqual(doc->selectedRev.body, kBody);
+            c4doc_free(doc);
+        }
+        c4db_getBodyCacheStats(db, &hits, &misses);
+        AssertEqual(misses, (uint64_t)1);
+        AssertEqual(hits, (uint64_t)1);
+    }
+
+
     void testAllDocsIncludeDeleted() {
         char docID[20];
         setupAllDocs();
@@ -534,7 +957,17 @@ class C4DatabaseTest : public C4Test {
     CPPUNIT_TEST( testCreateVersionedDoc );
     CPPUNIT_TEST( testCreateMultipleRevisions );
     CPPUNIT_TEST( testInsertRevisionWithHistory );
+    CPPUNIT_TEST( testLargeRevTree );
+    CPPUNIT_TEST( testPruneRevisions );
+    CPPUNIT_TEST( testPutBatch );
+    CPPUNIT_TEST( testPutBatchStorageError );
     CPPUNIT_TEST( testAllDocs );
+    CPPUNIT_TEST( testAllDocsPrefetch );
+    CPPUNIT_TEST( testGetDocuments );
+    CPPUNIT_TEST( testSnapshot );
+    CPPUNIT_TEST( testConcurrentReads );
+    CPPUNIT_TEST( testSeparateConflictBodies );
+    CPPUNIT_TEST( testBodyCache );
     CPPUNIT_TEST( testAllDocsInfo );
     CPPUNIT_TEST( testAllDocsIncludeDeleted );
     CPPUNIT_TEST( testChanges );
@@ -10,6 +10,7 @@
 #include "c4View.h"
 #include "c4DocEnumerator.h"
 #include <iostream>
+#include <limits.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
@@ -9,6 +9,7 @@
 #include "c4Test.hh"
 #include "c4View.h"
 #include "c4DocEnumerator.h"
+#include <atomic>
 #include <iostream>
 #ifndef _MSC_VER
 #include <unistd.h>
@@ -16,8 +17,10 @@
 
 #ifdef _MSC_VER
 static const char *kViewIndexPath = "C:\\tmp\\forest_temp.view.index";
+static const char *kView2IndexPath = "C:\\tmp\\forest_temp2.view.index";
 #else
 static const char *kViewIndexPath = "/tmp/forest_temp.view.index";
+static const char *kView2IndexPath = "/tmp/forest_temp2.view.index";
 #endif
 
 
@@ -100,6 +103,130 @@ public:
         AssertEqual(c4view_getLastSequenceChangedAt(view), (C4SequenceNumber)100);
     }
 
+    static bool mapDoc(void *context, C4Document *doc, unsigned viewNumber,
+                       C4KeyValueList *kv, C4Error *outError)
+    {
+        C4Key *keys[2] = {c4key_new(), c4key_new()};
+        c4key_addString(keys[0], doc->docID);
+        c4key_addNumber(keys[1], doc->sequence);
+        c4kv_add(kv, keys[0], c4str("1234"));
+        c4kv_add(kv, keys[1], c4str("1234"));
+        c4key_free(keys[0]);
+        c4key_free(keys[1]);
+        ++*(std::atomic_int*)context;
+        return true;
+    }
+
+    void testPipelinedIndex() {
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+
+        C4Error error;
+        C4Indexer* ind = c4indexer_begin(db, &view, 1, &error);
+        Assert(ind);
+        std::atomic_int mapCount {0};
+        Assert(c4indexer_runPipelined(ind, 4, &mapDoc, &mapCount, &error));
+        Assert(c4indexer_end(ind, true, &error));
+
+        AssertEqual((int)mapCount, 100);
+        AssertEqual(c4view_getTotalRows(view), (C4SequenceNumber)200);
+        AssertEqual(c4view_getLastSequenceIndexed(view), (C4SequenceNumber)100);
+        AssertEqual(c4view_getLastSequenceChangedAt(view), (C4SequenceNumber)100);
+
+        // Nothing left to index:
+        ind = c4indexer_begin(db, &view, 1, &error);
+        Assert(ind);
+        Assert(c4indexer_runPipelined(ind, 4, &mapDoc, &mapCount, &error));
+        Assert(c4indexer_end(ind, true, &error));
+        AssertEqual((int)mapCount, 100);
+    }
+
+    void testPipelinedIndexWithDeletions() {
+        createIndex();  // 100 docs, indexed into the first view
+
+        // Add docs, deleting every third one. Deleted docs pass through the pipeline without
+        // being mapped, so the emitter can pop them before any mapper has reached them:
+        char docID[20];
+        for (int i = 101; i <= 400; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+            if (i % 3 == 0)
+                createRev(c4str(docID), kRev2ID, kC4SliceNull);
+        }
+        const int kLiveDocs = 100 + 200;
+
+        // The second view is new, while the first has already caught up with doc-100:
+        ::unlink(kView2IndexPath);
+        C4Error error;
+        C4View *view2 = c4view_open(db, c4str(kView2IndexPath), c4str("myview2"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(view2);
+        C4View *views[2] = {view, view2};
+        C4Indexer* ind = c4indexer_begin(db, views, 2, &error);
+        Assert(ind);
+        std::atomic_int mapCount {0};
+        Assert(c4indexer_runPipelined(ind, 4, &mapDoc, &mapCount, &error));
+        Assert(c4indexer_end(ind, true, &error));
+
+        AssertEqual((int)mapCount, kLiveDocs + (kLiveDocs - 100));
+        AssertEqual(c4view_getTotalRows(view), (C4SequenceNumber)(2 * kLiveDocs));
+        AssertEqual(c4view_getTotalRows(view2), (C4SequenceNumber)(2 * kLiveDocs));
+        AssertEqual(c4view_getLastSequenceIndexed(view), c4db_getLastSequence(db));
+        AssertEqual(c4view_getLastSequenceIndexed(view2), c4db_getLastSequence(db));
+
+        Assert(c4view_delete(view2, &error));
+        c4view_free(view2);
+    }
+
+    void testIndexMultipleViews() {
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+
+        ::unlink(kView2IndexPath);
+        C4Error error;
+        C4View *view2 = c4view_open(db, c4str(kView2IndexPath), c4str("myview2"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(view2);
+
+        // Two views are indexed in parallel; view 2 only emits for odd sequences:
+        C4View *views[2] = {view, view2};
+        C4Indexer* ind = c4indexer_begin(db, views, 2, &error);
+        Assert(ind);
+        C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+        Assert(e);
+        C4Document *doc;
+        while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+            for (unsigned v = 0; v < 2; ++v) {
+                Assert(c4indexer_shouldIndexDocument(ind, v, doc));
+                C4Key *key = c4key_new();
+                c4key_addString(key, doc->docID);
+                C4Slice value = c4str("1234");
+                unsigned count = (v == 0 || doc->sequence % 2) ? 1 : 0;
+                Assert(c4indexer_emit(ind, doc, v, count, &key, &value, &error));
+                c4key_free(key);
+            }
+            c4doc_free(doc);
+        }
+        AssertEqual(error.code, 0);
+        c4enum_free(e);
+        Assert(c4indexer_end(ind, true, &error));
+
+        AssertEqual(c4view_getTotalRows(view), (C4SequenceNumber)100);
+        AssertEqual(c4view_getTotalRows(view2), (C4SequenceNumber)50);
+        AssertEqual(c4view_getLastSequenceIndexed(view), (C4SequenceNumber)100);
+        AssertEqual(c4view_getLastSequenceIndexed(view2), (C4SequenceNumber)100);
+        AssertEqual(c4view_getLastSequenceChangedAt(view2), (C4SequenceNumber)99);
+
+        Assert(c4view_delete(view2, &error));
+        c4view_free(view2);
+    }
+
     void testQueryIndex() {
         createIndex();
 
@@ -299,6 +426,9 @@ public:
     CPPUNIT_TEST_SUITE( C4ViewTest );
     CPPUNIT_TEST( testEmptyState );
     CPPUNIT_TEST( testCreateIndex );
+    CPPUNIT_TEST( testIndexMultipleViews );
+    CPPUNIT_TEST( testPipelinedIndex );
+    CPPUNIT_TEST( testPipelinedIndexWithDeletions );
     CPPUNIT_TEST( testQueryIndex );
     CPPUNIT_TEST( testIndexVersion );
     CPPUNIT_TEST( testDocPurge );
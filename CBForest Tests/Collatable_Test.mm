@@ -250,4 +250,100 @@ static NSString* toJSON(Collatable c) {
     AssertEqual(toJSON(c), @"{\"name\":\"Frank\",\"age\":11}");
 }
 
+static void addItems(CollatableBuilder &b, int n) {
+    b.beginArray();
+    for (int i = 0; i < n; ++i)
+        b << i << "item";
+    b.endArray();
+}
+
+- (void) checkItems: (slice)data count: (int)n {
+    CollatableReader reader(data);
+    reader.beginArray();
+    for (int i = 0; i < n; ++i) {
+        AssertEq(reader.readInt(), i);
+        Assert(reader.readString() == slice("item"));
+    }
+    AssertEq(reader.peekTag(), CollatableReader::kEndSequence);
+}
+
+- (void) testBuilderStorage {
+    // Moving a builder whose data is still in its inline buffer:
+    CollatableBuilder a;
+    addItems(a, 3);
+    Assert(a.size() < 128);
+    alloc_slice small(a.data());
+    CollatableBuilder b(std::move(a));
+    Assert(b.data() == small);
+    Assert(a.empty());
+    a << "reused";
+    Assert(a.data() == CollatableBuilder("reused").data());
+
+    // Growing onto the heap, then moving that:
+    CollatableBuilder big;
+    addItems(big, 50);
+    Assert(big.size() > 128);
+    [self checkItems: big count: 50];
+    alloc_slice bigData(big.data());
+    CollatableBuilder big2(std::move(big));
+    Assert(big2.data() == bigData);
+    Assert(big.empty());
+    b = std::move(big2);
+    Assert(b.data() == bigData);
+    Assert(big2.empty());
+
+    // reset() keeps the heap buffer for reuse:
+    b.reset();
+    Assert(b.empty());
+    addItems(b, 50);
+    Assert(b.data() == bigData);
+
+    // extractOutput() of heap and of inline data leaves the builder empty and reusable:
+    alloc_slice out = b.extractOutput();
+    Assert(out == bigData);
+    Assert(b.empty());
+    addItems(b, 3);
+    out = b.extractOutput();
+    Assert(out == small);
+    Assert(b.empty());
+    [self checkItems: out count: 3];
+}
+
+- (void) testStringLengths {
+    // Strings of 16 bytes or more are mapped 16 or 32 bytes at a time, so check lengths around
+    // those boundaries against the encoding of each byte on its own. Bytes >= 0x80 must pass
+    // through unchanged. (DEL is skipped since it decodes as a space; see testStrings.)
+    uint8_t mapped[256];
+    CollatableBuilder one;
+    for (int ch = 0; ch < 256; ++ch) {
+        char c = (char)ch;
+        one.reset();
+        one << slice(&c, 1);
+        AssertEq(one.size(), 3u);
+        mapped[ch] = one.data()[1];
+        if (ch >= 0x80)
+            Assert(mapped[ch] == ch);
+    }
+    for (size_t len : {15, 16, 17, 31, 32, 33, 47, 48, 49, 63, 64, 65, 100}) {
+        for (int rep = 0; rep < 10; ++rep) {
+            std::string str(len, ' ');
+            for (size_t i = 0; i < len; ++i) {
+                do {
+                    str[i] = (char)randn(256);
+                } while (str[i] == '\177');
+            }
+            CollatableBuilder c;
+            c << str;
+            slice encoded = c.data();
+            AssertEq(encoded.size, len + 2);
+            Assert(encoded[0] == CollatableTypes::kString);
+            Assert(encoded[len + 1] == 0);
+            for (size_t i = 0; i < len; ++i)
+                AssertEq(encoded[1 + i], mapped[(uint8_t)str[i]]);
+            CollatableReader reader(encoded);
+            Assert(reader.readString() == slice(str));
+        }
+    }
+}
+
 @end
@@ -10,6 +10,8 @@
 #import "testutil.h"
 #import "Database.hh"
 #import "DocEnumerator.hh"
+#import <mutex>
+#import <thread>
 
 using namespace cbforest;
 
@@ -597,4 +599,122 @@ static void onCompact(void *context, bool compacting) {
     Assert(doc.exists());
 }
 
+
+// Starts a transaction on another thread, which has to wait until the one passed in ends, and so
+// joins its group commit. Ends t once the other thread is waiting.
+- (void) groupCommit: (Transaction&)t abortSecond: (bool)abortSecond {
+    std::thread second([&]{
+        Transaction t2(db);
+        t2.set(nsstring_slice(@"b"), nsstring_slice(@"B"));
+        if (abortSecond)
+            t2.abort();
+        t2.commit();
+    });
+    try {
+        db->waitForGroupJoiners(1);
+        t.commit();
+    } catch (...) {
+        second.join();
+        throw;
+    }
+    second.join();
+}
+
+- (void) test15_GroupCommit {
+    db->setGroupCommit(true);
+    Transaction t(db);
+    t.set(nsstring_slice(@"a"), nsstring_slice(@"A"));
+    [self groupCommit: t abortSecond: false];
+    Assert(db->get(nsstring_slice(@"a")).exists());
+    Assert(db->get(nsstring_slice(@"b")).exists());
+}
+
+- (void) test16_GroupCommitAbort {
+    // The second writer aborts, which rolls back the whole group, so the first one fails:
+    db->setGroupCommit(true);
+    Transaction t(db);
+    t.set(nsstring_slice(@"a"), nsstring_slice(@"A"));
+    bool failed = false;
+    try {
+        [self groupCommit: t abortSecond: true];
+    } catch (const error &x) {
+        AssertEq(x.status, (int)FDB_RESULT_TRANSACTION_FAIL);
+        failed = true;
+    }
+    Assert(failed);
+    Assert(!db->get(nsstring_slice(@"a")).exists());
+    Assert(!db->get(nsstring_slice(@"b")).exists());
+}
+
+// Runs a parallelScan and checks that its workers together visit exactly the docs a serial
+// enumeration does, each worker in ascending order.
+- (void) checkParallelScanBySequence: (bool)bySequence {
+    std::vector<std::pair<std::string, sequence>> serial;
+    if (bySequence) {
+        for (DocEnumerator e(*db, (sequence)1); e.next(); )
+            serial.push_back({(std::string)e->key(), e->sequence()});
+    } else {
+        for (DocEnumerator e(*db); e.next(); )
+            serial.push_back({(std::string)e->key(), e->sequence()});
+    }
+
+    const unsigned kWorkers = 4;
+    std::mutex mutex;
+    std::vector<std::vector<std::pair<std::string, sequence>>> ranges(kWorkers);
+    DocEnumerator::parallelScan(*db, kWorkers, bySequence, DocEnumerator::Options::kDefault,
+                                [&](unsigned worker, const Document &doc) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Assert(worker < kWorkers);
+        ranges[worker].push_back({(std::string)doc.key(), doc.sequence()});
+        return true;
+    });
+
+    std::vector<std::pair<std::string, sequence>> all;
+    for (auto &range : ranges) {
+        for (size_t i = 1; i < range.size(); ++i) {
+            if (bySequence)
+                Assert(range[i-1].second < range[i].second);
+            else
+                Assert(range[i-1].first < range[i].first);
+        }
+        all.insert(all.end(), range.begin(), range.end());
+    }
+    auto byKey = [](const std::pair<std::string, sequence> &a,
+                    const std::pair<std::string, sequence> &b) {return a.first < b.first;};
+    std::sort(all.begin(), all.end(), byKey);
+    std::sort(serial.begin(), serial.end(), byKey);
+    Assert(all == serial);
+}
+
+- (void) test17_ParallelScan {
+    // An empty store has no splits and nothing to scan, by key or by sequence:
+    AssertEq(DocEnumerator::splitKeys(*db, 4).size(), 0u);
+    for (int bySequence = 0; bySequence <= 1; ++bySequence) {
+        DocEnumerator::parallelScan(*db, 4, bySequence, DocEnumerator::Options::kDefault,
+                                    [&](unsigned worker, const Document &doc) {
+            XCTFail(@"Shouldn't have found any docs");
+            return true;
+        });
+    }
+
+    // Update and delete some docs, leaving obsolete sequences for the ranges to skip over:
+    [self createNumberedDocs];
+    {
+        Transaction t(db);
+        for (int i = 1; i <= 20; i++)
+            t.set(nsstring_slice([NSString stringWithFormat: @"doc-%03d", i]),
+                  nsstring_slice(@"updated"));
+        for (int i = 50; i < 55; i++)
+            t.del(nsstring_slice([NSString stringWithFormat: @"doc-%03d", i]));
+    }
+
+    auto splits = DocEnumerator::splitKeys(*db, 4);
+    Assert(splits.size() > 0 && splits.size() <= 3);
+    for (size_t i = 1; i < splits.size(); ++i)
+        Assert(splits[i-1] < splits[i]);
+
+    [self checkParallelScanBySequence: false];
+    [self checkParallelScanBySequence: true];
+}
+
 @end
@@ -10,6 +10,7 @@
 #import "testutil.h"
 #import "Index.hh"
 #import "Collatable.hh"
+#import "varint.hh"
 
 using namespace cbforest;
 
@@ -237,6 +238,116 @@ static boolBlock scopedEnumerate() {
     XCTAssertEqual([self doQuery], 3);
 }
 
+// Re-indexes a doc whose keys shift position: the second key stays the same while the first
+// changes, so the row at index 1 is overwritten while the old row at index 0 is deleted.
+- (void) shiftKeysBatched: (bool)batched {
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        writer.setBatched(batched);
+        [self updateDoc: @"doc1" body: @[@"v", @"X", @"A"] writer: writer];
+        writer.flush();
+    }
+    XCTAssertEqual([self doQuery], 2);
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        writer.setBatched(batched);
+        [self updateDoc: @"doc1" body: @[@"v", @"Y", @"A"] writer: writer];
+        writer.flush();
+    }
+    XCTAssertEqual([self doQuery], 2);
+
+    NSMutableArray* keys = [NSMutableArray array];
+    for (IndexEnumerator e(index, Collatable(), cbforest::slice::null,
+                           Collatable(), cbforest::slice::null,
+                           DocEnumerator::Options::kDefault); e.next(); ) {
+        alloc_slice keyStr = e.key().readString();
+        [keys addObject: [[NSString alloc] initWithBytes: keyStr.buf length: keyStr.size
+                                                encoding: NSUTF8StringEncoding]];
+    }
+    AssertEqual(keys, (@[@"A", @"Y"]));
+}
+
+- (void) testShiftedKeys {
+    [self shiftKeysBatched: false];
+}
+
+- (void) testShiftedKeysBatched {
+    [self shiftKeysBatched: true];
+}
+
+// Re-indexes doc1, emitting "a" -> valueA and "b" -> "vb".
+- (bool) reindexWithValue: (const char*)valueA sequence: (sequence)seq {
+    Transaction trans(database);
+    IndexWriter writer(index, trans);
+    std::vector<Collatable> keys {CollatableBuilder("a"), CollatableBuilder("b")};
+    std::vector<alloc_slice> values {alloc_slice(valueA), alloc_slice("vb")};
+    return writer.update(slice("doc1"), seq, keys, values, _rowCount);
+}
+
+// Overwrites doc1's row for key "a" behind the IndexWriter's back, keeping its sequence.
+- (void) tamperWithRowA: (sequence)seq {
+    CollatableBuilder rowKey;
+    rowKey.beginArray() << CollatableBuilder("a") << CollatableBuilder(slice("doc1"));
+    rowKey.endArray();
+    uint8_t meta[10];
+    Transaction trans(database);
+    trans(database->getKeyStore("index")).set(rowKey, slice(meta, PutUVarInt(meta, seq)),
+                                              slice("tampered"));
+}
+
+// Returns doc1's rows as "key=value@sequence" strings.
+- (NSArray*) doc1Rows {
+    NSMutableArray* rows = [NSMutableArray array];
+    for (IndexEnumerator e(index, Collatable(), cbforest::slice::null,
+                           Collatable(), cbforest::slice::null,
+                           DocEnumerator::Options::kDefault); e.next(); ) {
+        [rows addObject: [NSString stringWithFormat: @"%@=%@@%llu",
+                          (NSString*)e.key().readString(), (NSString*)e.value(),
+                          (unsigned long long)e.sequence()]];
+    }
+    return rows;
+}
+
+- (void) testValueFingerprints {
+    Assert([self reindexWithValue: "va" sequence: 1]);
+    AssertEq(_rowCount, 2u);
+    AssertEqual([self doc1Rows], (@[@"a=va@1", @"b=vb@1"]));
+
+    // Unchanged values are skipped by fingerprint, without reading the rows; if the row were
+    // read, the tampered value wouldn't match and would be rewritten:
+    [self tamperWithRowA: 1];
+    Assert(![self reindexWithValue: "va" sequence: 2]);
+    AssertEq(_rowCount, 2u);
+    AssertEqual([self doc1Rows], (@[@"a=tampered@1", @"b=vb@1"]));
+
+    // A changed value under the same key rewrites just that row:
+    Assert([self reindexWithValue: "va2" sequence: 3]);
+    AssertEq(_rowCount, 2u);
+    AssertEqual([self doc1Rows], (@[@"a=va2@3", @"b=vb@1"]));
+
+    // Strip the fingerprints from doc1's entry, as written before they existed. Then the rows
+    // are read and compared, so the tampered one is rewritten and the other is skipped:
+    {
+        CollatableBuilder docKey(slice("doc1"));
+        KeyStore& store = database->getKeyStore("index");
+        Document entry = store.get(docKey);
+        AssertEq(entry.meta().size, 2*8u);
+        Transaction trans(database);
+        trans(store).set(docKey, slice::null, entry.body());
+    }
+    [self tamperWithRowA: 3];
+    Assert([self reindexWithValue: "va2" sequence: 4]);
+    AssertEq(_rowCount, 2u);
+    AssertEqual([self doc1Rows], (@[@"a=va2@4", @"b=vb@1"]));
+
+    // Writing a row restored the fingerprints:
+    [self tamperWithRowA: 4];
+    Assert(![self reindexWithValue: "va2" sequence: 5]);
+    AssertEqual([self doc1Rows], (@[@"a=tampered@4", @"b=vb@1"]));
+}
+
 - (void) testBlockScopedObjects {
     boolBlock block = scopedEnumerate();
     while (block()) {
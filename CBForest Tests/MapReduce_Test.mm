@@ -118,6 +118,21 @@ static void updateIndex(Database *indexDB, MapReduceIndex* index) {
 }
 
 
+// Returns all of an index's rows as "key docID value" strings, in index order.
+- (NSArray*) rowsOf: (MapReduceIndex*)idx {
+    NSMutableArray* rows = [NSMutableArray array];
+    for (IndexEnumerator e(idx, Collatable(), cbforest::slice::null,
+                           Collatable(), cbforest::slice::null,
+                           DocEnumerator::Options::kDefault); e.next(); ) {
+        CollatableReader valueReader(e.value());
+        [rows addObject: [NSString stringWithFormat: @"%@ %@ %@",
+                          (NSString*)e.key().readString(), (NSString*)e.docID(),
+                          (NSString*)valueReader.readString()]];
+    }
+    return rows;
+}
+
+
 - (void) createDocsAndIndex {
     {
         // Populate the database:
@@ -199,4 +214,72 @@ static void updateIndex(Database *indexDB, MapReduceIndex* index) {
     AssertEq(index->lastSequenceChangedAt(), lastChangedAt);
 }
 
+
+- (void) testRebuildMatchesIncremental {
+    [self createDocsAndIndex];
+    MapReduceIndex index2(db, "index2", db);
+    index2.setup(0, "1");
+    updateIndex(db, index);
+    updateIndex(db, &index2);
+
+    // Change the docs, updating index2 incrementally after each change:
+    NSDictionary* body = @{@"name": @"Oregon",
+                           @"cities": @[@"Portland", @"Walla Walla", @"Salem"]};
+    Transaction(db).set(nsstring_slice(@"OR"), cbforest::slice::null, JSONToData(body,NULL));
+    updateIndex(db, &index2);
+    Transaction(db).del(nsstring_slice(@"CA"));
+    updateIndex(db, &index2);
+    body = @{@"name": @"Nevada", @"cities": @[@"Reno", @"Las Vegas"]};
+    Transaction(db).set(nsstring_slice(@"NV"), cbforest::slice::null, JSONToData(body,NULL));
+    updateIndex(db, &index2);
+
+    // Invalidate the first index, so it's rebuilt from scratch:
+    index->setup(0, "2");
+    updateIndex(db, index);
+    AssertEq(numMapCalls, 3);
+
+    NSArray* rows = [self rowsOf: index];
+    AssertEq(rows.count, 8u);
+    AssertEqual(rows, [self rowsOf: &index2]);
+    AssertEq(index->rowCount(), index2.rowCount());
+}
+
+- (void) testStaleStateNotRebuilt {
+    [self createDocsAndIndex];
+    updateIndex(db, index);
+
+    // Change OR's cities without updating the index:
+    NSDictionary* body = @{@"name": @"Oregon", @"cities": @[@"Salem"]};
+    Transaction(db).set(nsstring_slice(@"OR"), cbforest::slice::null, JSONToData(body,NULL));
+
+    // Mark the saved state as an obsolete format. It reads as nothing indexed, but the store
+    // still has the old rows, so re-indexing mustn't take the rebuild path (which would leave
+    // OR's old rows behind):
+    {
+        CollatableBuilder stateKey;
+        stateKey.addNull();
+        CollatableBuilder state;
+        state.beginArray();
+        state << (double)index->lastSequenceIndexed() << (double)index->lastSequenceChangedAt()
+              << "1" << 0.0 << (double)index->rowCount() << 3.0 /*format*/ << 0.0;
+        state.endArray();
+        Transaction t(db);
+        t(db->getKeyStore("index")).set(stateKey, state);
+    }
+    delete index;
+    index = new MapReduceIndex(db, "index", db);
+    index->setup(0, "1");
+    AssertEq(index->lastSequenceIndexed(), 0u);
+
+    updateIndex(db, index);
+    AssertEq(numMapCalls, 3);
+    AssertEqual([self rowsOf: index], (@[@"Cambria CA California",
+                                         @"Port Townsend WA Washington",
+                                         @"Salem OR Oregon",
+                                         @"San Francisco CA California",
+                                         @"San Jose CA California",
+                                         @"Seattle WA Washington",
+                                         @"Skookumchuk WA Washington"]));
+}
+
 @end
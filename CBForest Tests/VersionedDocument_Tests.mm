@@ -158,4 +158,191 @@ static revidBuffer stringToRev(NSString* str) {
     }
 }
 
+
+// A rev tree saved by an earlier version, in the legacy (v1) format: 3-cccc and 2-dddd are leaves,
+// the children of 2-bbbb and 1-aaaa respectively; 2-bbbb's parent is 1-aaaa.
+static const uint8_t kV1Tree[] = {
+    0x00, 0x00, 0x00, 0x13, 0x00, 0x02, 0x82, 0x03, 0x03, 0xcc, 0xcc, 0x00,
+    0x7b, 0x22, 0x61, 0x22, 0x3a, 0x33, 0x7d, 0x00, 0x00, 0x00, 0x13, 0x00,
+    0x03, 0x82, 0x03, 0x02, 0xdd, 0xdd, 0x00, 0x7b, 0x22, 0x62, 0x22, 0x3a,
+    0x32, 0x7d, 0x00, 0x00, 0x00, 0x13, 0x00, 0x03, 0x80, 0x03, 0x02, 0xbb,
+    0xbb, 0x00, 0x7b, 0x22, 0x61, 0x22, 0x3a, 0x32, 0x7d, 0x00, 0x00, 0x00,
+    0x13, 0xff, 0xff, 0x80, 0x03, 0x01, 0xaa, 0xaa, 0x00, 0x7b, 0x22, 0x61,
+    0x22, 0x3a, 0x31, 0x7d, 0x00, 0x00, 0x00, 0x00
+};
+
+- (void) checkV1Tree: (RevTree&)tree {
+    AssertEq(tree.size(), 4u);
+    Assert(tree.hasConflict());
+    auto rev3c = tree.get(stringToRev(@"3-cccc"));
+    auto rev2d = tree.get(stringToRev(@"2-dddd"));
+    auto rev2b = tree.get(stringToRev(@"2-bbbb"));
+    auto rev1a = tree.get(stringToRev(@"1-aaaa"));
+    Assert(rev3c && rev2d && rev2b && rev1a);
+    AssertEq(tree.currentRevision(), rev3c);
+    AssertEq(rev3c->parent(), rev2b);
+    AssertEq(rev2d->parent(), rev1a);
+    AssertEq(rev2b->parent(), rev1a);
+    AssertEq(rev1a->parent(), (const Revision*)NULL);
+    Assert(rev3c->isLeaf() && rev2d->isLeaf() && !rev2b->isLeaf() && !rev1a->isLeaf());
+    Assert(rev3c->inlineBody() == slice("{\"a\":3}"));
+    Assert(rev2d->inlineBody() == slice("{\"b\":2}"));
+    Assert(rev1a->sequence == 12);
+}
+
+- (void) test05_TreeFormats {
+    RevTree tree(slice(kV1Tree, sizeof(kV1Tree)), 12, 1234);
+    [self checkV1Tree: tree];
+    Assert(tree.get(stringToRev(@"2-bbbb"))->inlineBody() == slice("{\"a\":2}"));
+
+    // By default the tree is saved in the v1 format, readable by earlier versions:
+    alloc_slice v1 = tree.encode();
+    Assert(v1.size < sizeof(kV1Tree));     // non-leaf bodies are replaced by their offset
+    Assert(v1[0] != 0xF2);
+    RevTree tree1(v1, 12, 1234);
+    [self checkV1Tree: tree1];
+    Assert(tree1.get(stringToRev(@"2-bbbb"))->inlineBody().size == 0);
+
+    // Opting into v2 makes it smaller; that round-trips, and re-encodes to the same bytes:
+    tree1.setEncodeV2(true);
+    alloc_slice v2 = tree1.encode();
+    Assert(v2[0] == 0xF2);
+    Assert(v2.size < v1.size);
+    RevTree tree2(v2, 12, 1234);
+    [self checkV1Tree: tree2];
+    tree2.setEncodeV2(true);
+    Assert(tree2.encode() == v2);
+
+    // A v2 tree is saved back as v1 unless the owner opts in again:
+    RevTree tree3(v2, 12, 1234);
+    Assert(tree3.encode() == v1);
+}
+
+- (void) test06_SplicedEncoding {
+    // Grow a linear tree one rev at a time, as when a doc is updated repeatedly. Each update
+    // decodes the saved tree, adds a child to the current rev and prunes it, which lets encode()
+    // take its splicing fast path (which requires the v2 format.) A twin tree freshly decoded from a v1 copy of the same bytes
+    // can't splice, so it encodes in full; the results must be identical.
+    alloc_slice encoded;
+    {
+        RevTree tree;
+        int httpStatus;
+        tree.insert(stringToRev(@"1-0000"), slice("{\"gen\":1}"), false, false,
+                    revid(), false, httpStatus);
+        tree.setEncodeV2(true);
+        encoded = tree.encode();
+    }
+    for (unsigned gen = 2; gen <= 40; ++gen) {
+        sequence seq = gen;
+        uint64_t offset = 1000 * gen;
+        revidBuffer revID = stringToRev([NSString stringWithFormat: @"%u-%08x",
+                                                                    gen, gen * 2654435761u]);
+        NSString* bodyStr = [NSString stringWithFormat: @"{\"gen\":%u}", gen];
+        nsstring_slice body(bodyStr);
+
+        RevTree tree(encoded, seq, offset);
+        tree.setEncodeV2(true);
+        RevTree legacy(encoded, seq, offset);
+        alloc_slice legacyEncoded = legacy.encode();
+        RevTree fresh(legacyEncoded, seq, offset);
+        fresh.setEncodeV2(true);
+
+        int httpStatus;
+        for (RevTree *t : {&tree, &fresh}) {
+            Assert(t->insert(revID, body, false, false, t->currentRevision(), false, httpStatus));
+            t->prune(10);
+        }
+        encoded = tree.encode();
+        alloc_slice expected = fresh.encode();
+        Assert(encoded == expected);
+
+        RevTree check(encoded, seq, offset);
+        AssertEq(check.size(), (size_t)std::min(gen, 10u));
+        Assert(check.currentRevision()->revID == revID);
+        Assert(check.currentRevision()->inlineBody() == body);
+    }
+}
+
+- (void) test07_InsertHistoryHandle {
+    RevTree tree;
+    int httpStatus;
+    auto rev1 = tree.insert(stringToRev(@"1-aaaa"), slice("{\"n\":1}"), false, false,
+                            revid(), false, httpStatus);
+    auto rev1Handle = tree.handleOf(rev1);
+    tree.insert(stringToRev(@"2-bbbb"), slice("{\"n\":2}"), false, false,
+                rev1, false, httpStatus);
+
+    std::vector<revidBuffer> history {stringToRev(@"5-eeee"), stringToRev(@"4-dddd"),
+                                      stringToRev(@"3-cccc"), stringToRev(@"2-bbbb"),
+                                      stringToRev(@"1-aaaa")};
+    RevTree::RevHandle leaf;
+    AssertEq(tree.insertHistory(history, slice("{\"n\":5}"), false, false, &leaf), 3);
+    Assert(leaf);
+    tree.sort();
+    auto rev5 = tree.get(leaf);
+    Assert(rev5 && rev5->revID == history[0]);
+    Assert(rev5->inlineBody() == slice("{\"n\":5}"));
+    AssertEq(tree.currentRevision(), rev5);
+    AssertEq(rev5->parent(), tree.get(history[1]));
+
+    // Inserting a rev that's already present yields its handle:
+    RevTree::RevHandle existing;
+    AssertEq(tree.insertHistory({stringToRev(@"4-dddd"), stringToRev(@"3-cccc")},
+                                slice(), false, false, &existing), 0);
+    AssertEq(tree.get(existing), tree.get(history[1]));
+
+    // Handles survive pruning; a pruned rev's handle resolves to NULL:
+    AssertEq(tree.prune(3), 2u);
+    Assert(tree.get(leaf)->revID == history[0]);
+    AssertEq(tree.get(rev1Handle), (const Revision*)NULL);
+}
+
+- (void) test08_LazyDecode {
+    for (int v2 = 0; v2 <= 1; ++v2) {
+        // Build a linear tree of 10 revs, plus a deleted branch off 2-0002, saving it after each
+        // rev so that rev N gets sequence N:
+        alloc_slice encoded;
+        int httpStatus;
+        for (unsigned gen = 1; gen <= 10; ++gen) {
+            RevTree tree;
+            if (gen > 1)
+                tree.decode(encoded, gen - 1, 1000 * gen);
+            tree.setEncodeV2(v2);
+            tree.insert(stringToRev([NSString stringWithFormat: @"%u-%04x", gen, gen]),
+                        slice("{}"), false, false, tree.currentRevision(), false, httpStatus);
+            if (gen == 3)
+                tree.insert(stringToRev(@"3-ffff"), slice(), true, false,
+                            stringToRev(@"2-0002"), true, httpStatus);
+            encoded = tree.encode();
+        }
+
+        RevTree tree(encoded, 10, 10000);
+        AssertEq(tree.size(), 11u);
+        AssertEq(tree.decodedCount(), 0u);
+
+        // Reading the current revision decodes only that one:
+        auto current = tree.currentRevision();
+        Assert(current->revID == stringToRev(@"10-000a"));
+        AssertEq(current->sequence, 10ull);
+        AssertEq(tree.decodedCount(), 1u);
+        Assert(!tree.hasConflict());
+        AssertEq(tree.decodedCount(), 2u);
+
+        // Looking up a deep rev decodes as far as that rev:
+        auto deep = tree.get(stringToRev(@"3-0003"));
+        Assert(deep);
+        AssertEq(deep->sequence, 3ull);
+        AssertEq(tree.decodedCount(), deep->index() + 1u);
+        Assert(tree.getBySequence(5)->revID == stringToRev(@"5-0005"));
+        AssertEq(tree.decodedCount(), deep->index() + 1u);
+        Assert(tree.getBySequence(1)->revID == stringToRev(@"1-0001"));
+        AssertEq(tree.decodedCount(), 11u);
+
+        // Revs decoded earlier are still valid:
+        AssertEq(tree.get(0u), current);
+        Assert(deep->revID == stringToRev(@"3-0003"));
+        AssertEq(deep->parent(), tree.get(stringToRev(@"2-0002")));
+    }
+}
+
 @end
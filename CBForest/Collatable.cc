@@ -21,6 +21,11 @@
 #include <iomanip> // std::setprecision
 #include <algorithm> // std::max for MSVC
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CBF_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 namespace cbforest {
 
     static uint8_t kCharPriority[256];
@@ -29,6 +34,8 @@ namespace cbforest {
     static void initCharPriorityMap();
     static bool sCharPriorityMapInitialized;
 
+    static void mapBytes(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t table[256]);
+
 
     union swappedDouble {
         double asDouble;
@@ -54,7 +61,7 @@ namespace cbforest {
 
 
     CollatableBuilder::CollatableBuilder()
-    :_buf(slice::newBytes(kDefaultSize), kDefaultSize),
+    :_buf(_inline, kDefaultSize),
      _available(_buf)
     { }
 
@@ -67,19 +74,59 @@ namespace cbforest {
     { }
 
     CollatableBuilder::~CollatableBuilder() {
-        ::free((void*)_buf.buf);
+        if (!isInline())
+            ::free((void*)_buf.buf);
+    }
+
+    // Takes over c's data, leaving c empty. Inline data has to be copied.
+    void CollatableBuilder::moveFrom(CollatableBuilder &c) {
+        if (c.isInline()) {
+            size_t size = c.size();
+            ::memcpy(_inline, c._inline, size);
+            _buf = _available = slice(_inline, kDefaultSize);
+            _available.moveStart(size);
+        } else {
+            _buf = c._buf;
+            _available = c._available;
+        }
+        c._buf = c._available = slice(c._inline, kDefaultSize);
+    }
+
+    CollatableBuilder& CollatableBuilder::operator= (CollatableBuilder &&c) {
+        if (&c != this) {
+            if (!isInline())
+                ::free((void*)_buf.buf);
+            moveFrom(c);
+        }
+        return *this;
+    }
+
+    alloc_slice CollatableBuilder::extractOutput() {
+        alloc_slice result;
+        if (isInline())
+            result = alloc_slice(data());
+        else
+            result = alloc_slice::adopt(data());
+        _buf = _available = slice(_inline, kDefaultSize);
+        return result;
     }
 
     uint8_t* CollatableBuilder::reserve(size_t amt) {
         if (_available.size < amt) {
-            CBFAssert(_buf.buf);
             // grow:
             size_t curSize = size();
             size_t newSize = std::max(_buf.size, kMinSize/2);
             do {
                 newSize *= 2;
             } while (newSize < curSize + amt);
-            void* newBuf = slice::reallocBytes((void*)_buf.buf, newSize);
+            void* newBuf;
+            if (isInline()) {
+                newBuf = slice::newBytes(newSize);
+                ::memcpy(newBuf, _inline, curSize);
+            } else {
+                CBFAssert(_buf.buf);
+                newBuf = slice::reallocBytes((void*)_buf.buf, newSize);
+            }
             _buf = _available = slice(newBuf, newSize);
             _available.moveStart(curSize);
         }
@@ -111,10 +158,8 @@ namespace cbforest {
             initCharPriorityMap();
         auto dst = reserve(2 + s.size);
         *dst++ = t;
-        for (size_t i = 0; i < s.size; i++) {
-            *dst++ = kCharPriority[s[i]];
-        }
-        *dst = '\0';
+        mapBytes((const uint8_t*)s.buf, dst, s.size, kCharPriority);
+        dst[s.size] = '\0';
     }
 
     CollatableBuilder& CollatableBuilder::addFullTextKey(slice text, slice languageCode) {
@@ -206,9 +251,7 @@ namespace cbforest {
         size_t nBytes = _data.offsetOf(end);
 
         alloc_slice result(nBytes);
-
-        for (int i=0; i<nBytes; i++)
-            (uint8_t&)result[i] = kCharInversePriority[_data[i]];
+        mapBytes((const uint8_t*)_data.buf, (uint8_t*)result.buf, nBytes, kCharInversePriority);
         _data.moveStart(nBytes+1);
         return result;
     }
@@ -397,6 +440,99 @@ namespace cbforest {
     }
 
 
+#pragma mark - STRING MAPPING:
+
+    // Strings are encoded by mapping each byte through kCharPriority, and decoded by mapping
+    // through kCharInversePriority. Both maps leave bytes >= 0x80 unchanged, so the vector
+    // versions below only need the first 128 entries, which they look up as eight 16-byte tables.
+    // For table t, XORing a byte with t<<4 and then adding 0x70 (saturating) produces the byte's
+    // low nibble plus 0x70 if its high nibble is t, or else something >= 0x80. A byte shuffle
+    // turns the former into the table entry and the latter into 0, so ORing the eight results
+    // together maps every byte below 0x80.
+
+    typedef void (*MapBytesFn)(const uint8_t*, uint8_t*, size_t, const uint8_t*);
+
+    static void mapBytesScalar(const uint8_t *src, uint8_t *dst, size_t n,
+                               const uint8_t *table)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = table[src[i]];
+    }
+
+#if CBF_X86_SIMD
+    __attribute__((target("ssse3")))
+    static void mapBytesSSSE3(const uint8_t *src, uint8_t *dst, size_t n,
+                              const uint8_t *table)
+    {
+        __m128i tables[8];
+        for (int t = 0; t < 8; t++)
+            tables[t] = _mm_loadu_si128((const __m128i*)(table + 16*t));
+        const __m128i offset = _mm_set1_epi8(0x70), zero = _mm_setzero_si128();
+        size_t i;
+        for (i = 0; i + 16 <= n; i += 16) {
+            __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+            // Bytes >= 0x80 are unchanged:
+            __m128i out = _mm_and_si128(in, _mm_cmplt_epi8(in, zero));
+            for (int t = 0; t < 8; t++) {
+                __m128i index = _mm_adds_epu8(_mm_xor_si128(in, _mm_set1_epi8((char)(t << 4))),
+                                              offset);
+                out = _mm_or_si128(out, _mm_shuffle_epi8(tables[t], index));
+            }
+            _mm_storeu_si128((__m128i*)(dst + i), out);
+        }
+        mapBytesScalar(src + i, dst + i, n - i, table);
+    }
+
+    __attribute__((target("avx2")))
+    static void mapBytesAVX2(const uint8_t *src, uint8_t *dst, size_t n,
+                             const uint8_t *table)
+    {
+        // vpshufb looks up within each 128-bit lane, so each lane gets a copy of the tables.
+        __m256i tables[8];
+        for (int t = 0; t < 8; t++)
+            tables[t] = _mm256_broadcastsi128_si256(
+                                            _mm_loadu_si128((const __m128i*)(table + 16*t)));
+        const __m256i offset = _mm256_set1_epi8(0x70), zero = _mm256_setzero_si256();
+        size_t i;
+        for (i = 0; i + 32 <= n; i += 32) {
+            __m256i in = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i out = _mm256_and_si256(in, _mm256_cmpgt_epi8(zero, in));
+            for (int t = 0; t < 8; t++) {
+                __m256i index = _mm256_adds_epu8(
+                                    _mm256_xor_si256(in, _mm256_set1_epi8((char)(t << 4))),
+                                    offset);
+                out = _mm256_or_si256(out, _mm256_shuffle_epi8(tables[t], index));
+            }
+            _mm256_storeu_si256((__m256i*)(dst + i), out);
+        }
+        // (The tail is done by scalar code; calling the SSE version here would incur the
+        // penalty for switching between AVX and legacy SSE instructions.)
+        mapBytesScalar(src + i, dst + i, n - i, table);
+    }
+#endif
+
+    static MapBytesFn bestMapBytesFn() {
+#if CBF_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return mapBytesAVX2;
+        if (__builtin_cpu_supports("ssse3"))
+            return mapBytesSSSE3;
+#endif
+        return mapBytesScalar;
+    }
+
+    // Maps n bytes from src to dst through table, which must be kCharPriority or
+    // kCharInversePriority.
+    static void mapBytes(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t table[256]) {
+        static const MapBytesFn sMapBytes = bestMapBytesFn();
+        if (n < 16)
+            mapBytesScalar(src, dst, n, table);
+        else
+            sMapBytes(src, dst, n, table);
+    }
+
+
 #pragma mark - UTILITIES:
 
 
@@ -68,7 +68,9 @@ namespace cbforest {
     /** A binary encoding of JSON-compatible data, that collates with CouchDB-compatible semantics
         using a dumb binary compare (like memcmp).
         Data format spec: https://github.com/couchbaselabs/cbforest/wiki/Collatable-Data-Format
-        Collatable owns its data, in the form of a C++ string object. */
+        Collatable owns its data, in the form of a C++ string object.
+        Small builders don't touch the heap: the data starts out in a buffer inside the object,
+        and only moves to a malloc'ed one if it outgrows that. */
     class CollatableBuilder : public CollatableTypes {
     public:
         CollatableBuilder();
@@ -77,7 +79,7 @@ namespace cbforest {
         ~CollatableBuilder();
 
         template<typename T> explicit CollatableBuilder(const T &t)
-        :_buf(slice::newBytes(kDefaultSize), kDefaultSize),
+        :_buf(_inline, kDefaultSize),
          _available(_buf)
         {
             *this << t;
@@ -116,6 +118,10 @@ namespace cbforest {
         size_t size() const                         {return _buf.size - _available.size;}
         bool empty() const                          {return size() == 0;}
 
+        /** Removes all the data, but keeps the buffer, so a builder can be reused as scratch
+            space (e.g. once per row in a loop) without allocating again. */
+        void reset()                                {_available = _buf;}
+
         std::string toJSON() const;
 
         slice data() const                          {return slice(_buf.buf, size());}
@@ -123,31 +129,21 @@ namespace cbforest {
 
         operator Collatable () const                {return Collatable::withData(data());}
 
-        alloc_slice extractOutput() {
-            auto result = data();
-            _buf = _available = slice::null;
-            return alloc_slice::adopt(result);
-        }
+        /** Returns the data as an alloc_slice, and leaves the builder empty. */
+        alloc_slice extractOutput();
 
-        CollatableBuilder(CollatableBuilder&& c) {
-            _buf = c._buf;
-            _available = c._available;
-            c._buf.buf = NULL;
-        }
-        CollatableBuilder& operator= (CollatableBuilder &&c) {
-            _buf = c._buf;
-            _available = c._available;
-            c._buf.buf = NULL;
-            return *this;
-        }
+        CollatableBuilder(CollatableBuilder&& c)            {moveFrom(c);}
+        CollatableBuilder& operator= (CollatableBuilder &&c);
 
     private:
         static const size_t kMinSize = 32;
-        static const size_t kDefaultSize = 128;
+        static const size_t kDefaultSize = 128;     // Size of the inline buffer
 
         CollatableBuilder(const CollatableBuilder& c);
         CollatableBuilder& operator= (const CollatableBuilder &c);
 
+        bool isInline() const                       {return _buf.buf == _inline;}
+        void moveFrom(CollatableBuilder&);
         uint8_t* reserve(size_t amt);
         void add(slice);
         void addTag(Tag t)                          {uint8_t c = t; add(slice(&c,1));}
@@ -155,6 +151,7 @@ namespace cbforest {
 
         slice _buf;
         slice _available;
+        uint8_t _inline[kDefaultSize];              // Initial buffer, until data outgrows it
     };
 
 
@@ -21,7 +21,7 @@
 namespace cbforest {
 
     CollatableBuilder::CollatableBuilder(__unsafe_unretained id obj)
-    :_buf(slice::newBytes(kDefaultSize), kDefaultSize),
+    :_buf(_inline, kDefaultSize),
      _available(_buf)
     {
         if (obj)
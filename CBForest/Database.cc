@@ -61,6 +61,7 @@ namespace cbforest {
         std::mutex _transactionMutex;
         std::condition_variable _transactionCond;
         Transaction* _transaction {NULL};
+        std::shared_ptr<CommitGroup> _group;    // Open group commit, if any
 
         static std::unordered_map<std::string, File*> sFileMap;
         static std::mutex sMutex;
@@ -117,6 +118,31 @@ namespace cbforest {
         reopen();
     }
 
+    // Opens a separate read-only handle on the same file. If snapshotSequence is nonzero, the
+    // default KeyStore is a snapshot as of that sequence (FDB_SNAPSHOT_INMEM means the latest
+    // committed state); otherwise it tracks the file's committed state as it changes.
+    Database::Database(Database* original, sequence snapshotSequence)
+    :KeyStore(NULL),
+     _file(original->_file),
+     _config(original->_config)
+    {
+        _config.flags |= FDB_OPEN_FLAG_RDONLY;
+        _config.flags &= ~FDB_OPEN_FLAG_CREATE;
+        _config.compaction_cb = compactionCallback;
+        _config.compaction_cb_ctx = this;
+        reopen();
+        if (snapshotSequence != 0) {
+            Debug("Database: snapshot %s at sequence %llu",
+                  _file->_path.c_str(), (unsigned long long)snapshotSequence);
+            fdb_kvs_handle* snapshot;
+            check(fdb_snapshot_open(_handle, &snapshot, snapshotSequence));
+            fdb_kvs_close(_handle);
+            _handle = snapshot;     // fdb_close will close this too
+            _isSnapshot = true;
+            enableErrorLogs(true);
+        }
+    }
+
     Database::~Database() {
         Debug("Database: deleting (~Database)");
         CBFAssert(!_inTransaction);
@@ -145,6 +171,11 @@ namespace cbforest {
     KeyStore& Database::getKeyStore(std::string name) const {
         if (name.empty())
             return *const_cast<Database*>(this);
+        if (_isSnapshot) {
+            // Only the default KeyStore is frozen; any other would show the live data.
+            Warn("Database: can't open KVS '%s' of a snapshot", name.c_str());
+            error::_throw(FDB_RESULT_INVALID_ARGS);
+        }
         auto i = _keyStores.find(name);
         if (i != _keyStores.end() && i->second) {
             return *i->second;
@@ -269,23 +300,70 @@ namespace cbforest {
 
 #pragma mark - TRANSACTION:
 
+    // Max number of Transactions that will be committed together by a group commit
+    static const unsigned kMaxGroupCommitSize = 64;
+
+    // State shared by the Transactions in a group commit. They all write to a single ForestDB
+    // transaction, which is committed by whichever member ends last.
+    struct Database::CommitGroup {
+        CommitGroup(Database *d)    :db(d) { }
+        Database* const db;
+        unsigned members {0};
+        bool closing {false};                       // Commit in progress; no more members
+        bool done {false};
+        fdb_status status {FDB_RESULT_SUCCESS};
+    };
+
     void Database::beginTransaction(Transaction* t) {
-        CBFAssert(!_inTransaction);
+        if (!_groupCommit)
+            CBFAssert(!_inTransaction);
         if (!isOpen())
             error::_throw(FDB_RESULT_INVALID_HANDLE);
         std::unique_lock<std::mutex> lock(_file->_transactionMutex);
-        while (_file->_transaction != NULL)
-            _file->_transactionCond.wait(lock);
 
-        if (t->state() == Transaction::kCommit) {
-            Log("Database: beginTransaction");
-            check(fdb_begin_transaction(_fileHandle, FDB_ISOLATION_READ_COMMITTED));
+        if (_groupCommit && t->state() == Transaction::kCommit) {
+            // Wait for the current writer; then join its group if it's ours, else start a new one
+            ++_groupJoiners;
+            _file->_transactionCond.notify_all();       // for waitForGroupJoiners
+            while (_file->_transaction != NULL
+                   || (_file->_group && (_file->_group->db != this || _file->_group->closing)))
+                _file->_transactionCond.wait(lock);
+            --_groupJoiners;
+
+            if (_file->_group) {
+                Log("Database: join group commit");
+            } else {
+                Log("Database: beginTransaction (group commit)");
+                check(fdb_begin_transaction(_fileHandle, FDB_ISOLATION_READ_COMMITTED));
+                _file->_group = std::make_shared<CommitGroup>(this);
+            }
+            t->_group = _file->_group;
+            ++t->_group->members;
+        } else {
+            while (_file->_transaction != NULL || _file->_group)
+                _file->_transactionCond.wait(lock);
+
+            if (t->state() == Transaction::kCommit) {
+                Log("Database: beginTransaction");
+                check(fdb_begin_transaction(_fileHandle, FDB_ISOLATION_READ_COMMITTED));
+            }
         }
         _file->_transaction = t;
         _inTransaction = true;
     }
 
+    void Database::waitForGroupJoiners(unsigned count) {
+        std::unique_lock<std::mutex> lock(_file->_transactionMutex);
+        while (_groupJoiners < count)
+            _file->_transactionCond.wait(lock);
+    }
+
     void Database::endTransaction(Transaction* t) {
+        if (t->_group) {
+            endGroupTransaction(t);
+            return;
+        }
+
         fdb_status status = FDB_RESULT_SUCCESS;
         switch (t->state()) {
             case Transaction::kCommit:
@@ -304,12 +382,48 @@ namespace cbforest {
         std::unique_lock<std::mutex> lock(_file->_transactionMutex);
         CBFAssert(_file->_transaction == t);
         _file->_transaction = NULL;
-        _file->_transactionCond.notify_one();
+        _file->_transactionCond.notify_all();
         _inTransaction = false;
 
         check(status);
     }
 
+    void Database::endGroupTransaction(Transaction* t) {
+        auto group = t->_group;
+        std::unique_lock<std::mutex> lock(_file->_transactionMutex);
+        CBFAssert(_file->_transaction == t);
+        _file->_transaction = NULL;
+        _inTransaction = false;
+
+        if (t->state() == Transaction::kCommit && _groupJoiners > 0
+                                               && group->members < kMaxGroupCommitSize) {
+            // Other threads are waiting to add to this group; let them, and wait for the last
+            // one to commit:
+            _file->_transactionCond.notify_all();
+            while (!group->done)
+                _file->_transactionCond.wait(lock);
+        } else {
+            group->closing = true;
+            lock.unlock();
+            if (t->state() == Transaction::kCommit) {
+                Log("Database: group commit of %u transactions", group->members);
+                group->status = fdb_end_transaction(_fileHandle, FDB_COMMIT_NORMAL);
+            } else {
+                Log("Database: abort group commit of %u transactions", group->members);
+                (void)fdb_abort_transaction(_fileHandle);
+                group->status = FDB_RESULT_TRANSACTION_FAIL;
+            }
+            lock.lock();
+            group->done = true;
+            _file->_group.reset();
+            _file->_transactionCond.notify_all();
+            if (t->state() != Transaction::kCommit)
+                return;     // the aborting Transaction itself doesn't fail
+        }
+
+        check(group->status);
+    }
+
 
     Transaction::Transaction(Database* db)
     :KeyStoreWriter(*db),
@@ -327,6 +441,22 @@ namespace cbforest {
         _db.beginTransaction(this);
     }
 
+    Transaction::~Transaction() {
+        if (_active) {
+            try {
+                commit();
+            } catch (const std::exception &x) {
+                Warn("Transaction: failed to commit: %s", x.what());
+            }
+        }
+    }
+
+    void Transaction::commit() {
+        CBFAssert(_active);
+        _active = false;
+        _db.endTransaction(this);
+    }
+
     void Transaction::check(fdb_status status) {
         if (expected(status != FDB_RESULT_SUCCESS, false)) {
             _state = kAbort;
@@ -19,6 +19,7 @@
 #include <vector>
 #include <unordered_map>
 #include <atomic> // for std::atomic_uint
+#include <memory>
 #ifdef check
 #undef check
 #endif
@@ -51,6 +52,13 @@ namespace cbforest {
         static void setDefaultConfig(const config&);
 
         Database(std::string path, const config&);
+
+        /** Opens an independent read-only handle on the same file as `original`, which can be
+            used concurrently with it. If snapshotSequence is nonzero, the default KeyStore is
+            frozen as of that sequence (which must be one at which a commit occurred), or as of
+            the latest commit if it's FDB_SNAPSHOT_INMEM, and getKeyStore() throws for any other
+            KeyStore, since it couldn't be frozen at the same point. Otherwise it sees each new
+            commit. */
         Database(Database* original, sequence snapshotSequence);
         virtual ~Database();
 
@@ -92,6 +100,19 @@ namespace cbforest {
 
         void rekey(const fdb_encryption_key&);
 
+        /** Enables group commit. When Transactions on this Database are ended by several threads
+            at about the same time, their changes are committed together by a single ForestDB
+            commit instead of one apiece. Each Transaction still has exclusive write access while
+            in scope, and its commit() still throws if the shared commit fails.
+            Since ForestDB can't roll back part of a transaction, a Transaction that aborts also
+            rolls back the other uncommitted members of its group; those fail with
+            FDB_RESULT_TRANSACTION_FAIL. */
+        void setGroupCommit(bool groupCommit)   {_groupCommit = groupCommit;}
+        bool groupCommit() const                {return _groupCommit;}
+        /** Blocks until at least `count` threads are waiting to join a group commit on this
+            Database, i.e. blocked in a Transaction constructor. (Used by tests.) */
+        void waitForGroupJoiners(unsigned count);
+
         /** The Database's default key-value store. (You can also just use the Database
             instance directly as a KeyStore since it inherits from it.) */
         const KeyStore& defaultKeyStore() const {return *this;}
@@ -106,11 +127,13 @@ namespace cbforest {
 
     private:
         class File;
+        struct CommitGroup;
         friend class KeyStore;
         friend class Transaction;
         fdb_kvs_handle* openKVS(std::string name) const;
         void beginTransaction(Transaction*);
         void endTransaction(Transaction*);
+        void endGroupTransaction(Transaction*);
 
         Database(const Database&) = delete;
         Database& operator=(const Database&) = delete;
@@ -136,13 +159,18 @@ namespace cbforest {
         std::unordered_map<std::string, std::unique_ptr<KeyStore> > _keyStores;
         bool _inTransaction {false};
         bool _isCompacting {false};
+        bool _isSnapshot {false};
+        bool _groupCommit {false};
+        unsigned _groupJoiners {0};         // # of threads waiting to join a group commit
         OnCompactCallback _onCompactCallback {nullptr};
         void  *_onCompactContext {nullptr};
     };
 
 
     /** Grants exclusive write access to a Database while in scope.
-        The transaction is committed when the object exits scope, unless abort() was called.
+        The transaction is committed when the object exits scope, unless abort() was called;
+        but since a destructor can't throw, a failure to commit is only logged. Call commit()
+        to end it early and find out whether the commit succeeded.
         Only one Transaction object can be created on a database file at a time.
         Not just per Database object; per database _file_. */
     class Transaction : public KeyStoreWriter {
@@ -154,7 +182,11 @@ namespace cbforest {
         };
 
         Transaction(Database*);
-        ~Transaction()                          {_db.endTransaction(this);}
+        ~Transaction();
+
+        /** Ends the transaction: commits it, or rolls it back if abort() was called.
+            Throws an exception if the commit fails. */
+        void commit();
 
         /** Converts a KeyStore to a KeyStoreWriter to allow write access. */
         KeyStoreWriter operator() (KeyStore& s)  {return KeyStoreWriter(s, *this);}
@@ -179,6 +211,8 @@ namespace cbforest {
 
         Database& _db;
         enum state _state;
+        bool _active {true};                // false after commit()
+        std::shared_ptr<Database::CommitGroup> _group;
     };
     
 }
@@ -17,12 +17,143 @@
 #include "LogInternal.hh"
 #include "forestdb.h"
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <limits.h>
+#include <mutex>
 #include <string.h>
+#include <thread>
 
 
 namespace cbforest {
 
+    // A KeyStore on a ForestDB in-memory snapshot of another handle. Closes the snapshot when
+    // destructed. (Opening a snapshot of a snapshot handle clones it.)
+    class SnapshotKeyStore : public KeyStore {
+    public:
+        SnapshotKeyStore(fdb_kvs_handle *source)
+        :KeyStore(openSnapshot(source))
+        { }
+
+        ~SnapshotKeyStore()                     {close();}
+
+        fdb_kvs_handle* handle() const          {return _handle;}
+
+    private:
+        static fdb_kvs_handle* openSnapshot(fdb_kvs_handle *source) {
+            fdb_kvs_handle *snapshot;
+            check(fdb_snapshot_open(source, &snapshot, FDB_SNAPSHOT_INMEM));
+            return snapshot;
+        }
+    };
+
+
+#pragma mark - PREFETCHER:
+
+
+    // Runs a DocEnumerator on a background thread, buffering up to `depth` documents ahead of
+    // the consumer. The source enumerator reads from its own snapshot handle, so the thread
+    // never touches a ForestDB handle that the caller is using.
+    class DocEnumerator::Prefetcher {
+    public:
+        Prefetcher(std::unique_ptr<SnapshotKeyStore> snapshot,
+                   std::unique_ptr<DocEnumerator> source,
+                   unsigned depth)
+        :_snapshot(std::move(snapshot)),
+         _source(std::move(source)),
+         _depth(depth)
+        {
+            start();
+        }
+
+        ~Prefetcher() {
+            stop();
+            _source.reset();        // closes its fdb_iterator before the snapshot goes away
+        }
+
+        // Moves the next document into `doc`, blocking until one is available.
+        bool next(Document &doc) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_queue.empty() && !_finished)
+                _cond.wait(lock);
+            if (_queue.empty()) {
+                if (_error)
+                    std::rethrow_exception(_error);
+                return false;
+            }
+            doc = std::move(_queue.front());
+            _queue.pop_front();
+            _cond.notify_all();
+            return true;
+        }
+
+        void seek(slice key) {
+            stop();
+            _queue.clear();
+            _source->seek(key);
+            start();
+        }
+
+    private:
+        void start() {
+            _cancelled = _finished = false;
+            _error = nullptr;
+            _thread = std::thread(&Prefetcher::run, this);
+        }
+
+        void stop() {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cancelled = true;
+                _cond.notify_all();
+            }
+            if (_thread.joinable())
+                _thread.join();
+        }
+
+        void run() {
+            try {
+                while (_source->next()) {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    while (_queue.size() >= _depth && !_cancelled)
+                        _cond.wait(lock);
+                    if (_cancelled)
+                        break;
+                    _queue.push_back(_source->moveDoc());
+                    _cond.notify_all();
+                }
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _error = std::current_exception();
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _finished = true;
+            _cond.notify_all();
+        }
+
+        std::unique_ptr<SnapshotKeyStore> _snapshot;
+        std::unique_ptr<DocEnumerator> _source;
+        const unsigned _depth;
+        std::deque<Document> _queue;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::thread _thread;
+        bool _cancelled {false}, _finished {false};
+        std::exception_ptr _error;
+    };
+
+
+    void DocEnumerator::startPrefetch(std::function<DocEnumerator*(KeyStore&)> makeSource) {
+        std::unique_ptr<SnapshotKeyStore> snapshot(new SnapshotKeyStore(_store->_handle));
+        std::unique_ptr<DocEnumerator> source(makeSource(*snapshot));
+        Debug("enum: prefetching %u docs ahead --> %p", _options.prefetchDepth, this);
+        _prefetcher = std::make_shared<Prefetcher>(std::move(snapshot), std::move(source),
+                                                   _options.prefetchDepth);
+    }
+
+
 #pragma mark - ENUMERATION:
 
 
@@ -34,6 +165,7 @@ namespace cbforest {
         true,
         false,
         KeyStore::kDefaultContent,
+        0,
     };
 
 
@@ -58,6 +190,13 @@ namespace cbforest {
     { }
 
 
+    // Options for the enumerator that a prefetching enumerator reads from
+    static DocEnumerator::Options sourceOptions(DocEnumerator::Options options) {
+        options.prefetchDepth = 0;
+        return options;
+    }
+
+
     // Key-range constructor
     DocEnumerator::DocEnumerator(KeyStore &store,
                                  slice startKey, slice endKey,
@@ -67,6 +206,12 @@ namespace cbforest {
         Debug("enum: DocEnumerator(%p, [%s] -- [%s]%s) --> %p",
               store.handle(), startKey.hexCString(), endKey.hexCString(),
               (options.descending ? " desc" : ""), this);
+        if (options.prefetchDepth > 0) {
+            startPrefetch([=](KeyStore &snapshot) {
+                return new DocEnumerator(snapshot, startKey, endKey, sourceOptions(options));
+            });
+            return;
+        }
         if (startKey.size == 0)
             startKey.buf = NULL;
         if (endKey.size == 0)
@@ -92,6 +237,12 @@ namespace cbforest {
     {
         Debug("enum: DocEnumerator(%p, #%llu -- #%llu) --> %p",
                 store.handle(), start, end, this);
+        if (options.prefetchDepth > 0) {
+            startPrefetch([=](KeyStore &snapshot) {
+                return new DocEnumerator(snapshot, start, end, sourceOptions(options));
+            });
+            return;
+        }
 
         sequence minSeq = start, maxSeq = end;
         if (options.descending)
@@ -116,9 +267,15 @@ namespace cbforest {
                                  const Options& options)
     :DocEnumerator(store, options)
     {
-        _docIDs = docIDs;
         Debug("enum: DocEnumerator(%p, %zu keys) --> %p",
                 store.handle(), docIDs.size(), this);
+        if (options.prefetchDepth > 0) {
+            startPrefetch([=](KeyStore &snapshot) {
+                return new DocEnumerator(snapshot, docIDs, sourceOptions(options));
+            });
+            return;
+        }
+        _docIDs = docIDs;
         if (_options.skip > 0)
             _docIDs.erase(_docIDs.begin(), _docIDs.begin() + _options.skip);
         if (_options.limit < _docIDs.size())
@@ -143,12 +300,14 @@ namespace cbforest {
         _curDocIndex = e._curDocIndex;
         _options = e._options;
         _skipStep = e._skipStep;
+        _prefetcher = std::move(e._prefetcher);
         return *this;
     }
 
 
     void DocEnumerator::close() {
         freeDoc();
+        _prefetcher.reset();
         if (_iterator) {
             Debug("enum: fdb_iterator_close(%p)", _iterator);
             fdb_iterator_close(_iterator);
@@ -158,6 +317,13 @@ namespace cbforest {
 
 
     bool DocEnumerator::next() {
+        if (_prefetcher) {
+            if (_prefetcher->next(_doc))
+                return true;
+            close();
+            return false;
+        }
+
         // Enumerating an array of docs is handled specially:
         if (_docIDs.size() > 0)
             return nextFromArray();
@@ -222,6 +388,11 @@ namespace cbforest {
 
     void DocEnumerator::seek(slice key) {
         Debug("enum: seek([%s])", key.hexCString());
+        if (_prefetcher) {
+            freeDoc();
+            _prefetcher->seek(key);
+            return;
+        }
         if (!_iterator)
             return;
 
@@ -260,4 +431,112 @@ namespace cbforest {
         _doc.setKey(slice::null);
     }
 
+
+#pragma mark - PARALLEL SCAN:
+
+
+    // Number of documents sampled per range by splitKeys()
+    static const unsigned kSamplesPerRange = 16;
+
+    std::vector<alloc_slice> DocEnumerator::splitKeys(KeyStore &store, unsigned count) {
+        std::vector<alloc_slice> splits;
+        sequence lastSeq = store.lastSequence();
+        if (count < 2 || lastSeq == 0)
+            return splits;
+
+        // Since sequences are assigned in order of update, the docs at evenly spaced sequences
+        // are a fair sample of the key space (obsolete sequences just get skipped.)
+        std::vector<alloc_slice> samples;
+        sequence nSamples = std::min((sequence)count * kSamplesPerRange, lastSeq);
+        for (sequence i = 1; i <= nSamples; ++i) {
+            fdb_doc doc = {};
+            doc.seqnum = lastSeq * i / nSamples;
+            if (fdb_get_metaonly_byseq(store._handle, &doc) == FDB_RESULT_SUCCESS) {
+                samples.push_back(alloc_slice::adopt(doc.key, doc.keylen));
+                ::free(doc.meta);
+            }
+        }
+        std::sort(samples.begin(), samples.end());
+
+        for (unsigned i = 1; i < count; ++i) {
+            size_t index = samples.size() * i / count;
+            if (index < samples.size() && (splits.empty() || splits.back() < samples[index]))
+                splits.push_back(samples[index]);
+        }
+        return splits;
+    }
+
+
+    void DocEnumerator::parallelScan(KeyStore &store,
+                                     unsigned numWorkers,
+                                     bool bySequence,
+                                     const Options &options,
+                                     const ScanCallback &callback)
+    {
+        // All workers read clones of one snapshot, so they see the same state of the store:
+        SnapshotKeyStore base(store._handle);
+        sequence lastSeq = base.lastSequence();
+        if (lastSeq == 0)
+            return;     // empty store (and a by-sequence range would be inverted)
+
+        Options rangeOptions = Options::kDefault;
+        rangeOptions.includeDeleted = options.includeDeleted;
+        rangeOptions.contentOptions = options.contentOptions;
+
+        // Compute the ranges, as pairs of sequences or of keys:
+        std::vector<std::pair<sequence, sequence>> seqRanges;
+        std::vector<alloc_slice> splits;
+        unsigned nRanges;
+        if (bySequence) {
+            numWorkers = (unsigned)std::max((sequence)1, std::min((sequence)numWorkers, lastSeq));
+            for (unsigned i = 0; i < numWorkers; ++i)
+                seqRanges.push_back({lastSeq * i / numWorkers + 1,
+                                     lastSeq * (i + 1) / numWorkers});
+            nRanges = (unsigned)seqRanges.size();
+        } else {
+            splits = splitKeys(base, numWorkers);
+            nRanges = (unsigned)splits.size() + 1;
+        }
+
+        std::vector<std::unique_ptr<SnapshotKeyStore>> snapshots;
+        for (unsigned i = 0; i < nRanges; ++i)
+            snapshots.emplace_back(new SnapshotKeyStore(base.handle()));
+
+        Debug("enum: parallelScan(%p) with %u workers", store._handle, nRanges);
+        std::atomic<bool> stop {false};
+        std::vector<std::exception_ptr> errors(nRanges);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < nRanges; ++i) {
+            threads.emplace_back([&, i]() {
+                try {
+                    std::unique_ptr<DocEnumerator> e;
+                    if (bySequence) {
+                        e.reset(new DocEnumerator(*snapshots[i],
+                                                  seqRanges[i].first, seqRanges[i].second,
+                                                  rangeOptions));
+                    } else {
+                        Options keyOptions = rangeOptions;
+                        keyOptions.inclusiveEnd = false;    // end key is the next range's start
+                        slice startKey = (i > 0) ? splits[i-1] : slice::null;
+                        slice endKey = (i < splits.size()) ? splits[i] : slice::null;
+                        e.reset(new DocEnumerator(*snapshots[i], startKey, endKey, keyOptions));
+                    }
+                    while (!stop && e->next()) {
+                        if (!callback(i, e->doc()))
+                            stop = true;
+                    }
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                    stop = true;
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        for (auto &error : errors)
+            if (error)
+                std::rethrow_exception(error);
+    }
+
 }
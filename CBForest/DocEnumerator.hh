@@ -17,6 +17,8 @@
 #define CBForest_DocEnumerator_hh
 
 #include "Document.hh"
+#include <functional>
+#include <memory>
 
 namespace cbforest {
 
@@ -28,6 +30,9 @@ namespace cbforest {
             while (e.next()) { ... }
         Inside the loop you can treat the enumerator as though it were a Document*, for example
         "e->key()".
+        If the prefetchDepth option is nonzero, a background thread reads up to that many
+        documents ahead of the caller, so that I/O overlaps with the caller's processing. In this
+        mode the enumerator reads from a snapshot of the KeyStore taken when it's created.
      */
     class DocEnumerator {
     public:
@@ -39,6 +44,7 @@ namespace cbforest {
             bool                     inclusiveEnd   :1;
             bool                     includeDeleted :1;
             KeyStore::contentOptions contentOptions :4;
+            unsigned                 prefetchDepth; ///< If nonzero, # of docs to read ahead
 
             static const Options kDefault;
         };
@@ -71,6 +77,28 @@ namespace cbforest {
 
         const Document& doc() const         {return _doc;}
 
+        /** Callback for parallelScan. Return false to stop the scan. */
+        typedef std::function<bool(unsigned worker, const Document&)> ScanCallback;
+
+        /** Enumerates an entire KeyStore using multiple threads. The key (or sequence) space is
+            split into up to `numWorkers` ranges holding roughly equal numbers of documents, and
+            each range is read by its own DocEnumerator on its own thread, using a clone of a
+            snapshot taken at the start. Each document is passed to the callback along with the
+            number of the worker that read it. A worker visits its range in ascending order, but
+            different workers call the callback concurrently.
+            Only the includeDeleted and contentOptions options are used.
+            Returns when all workers are done; if any of them threw an exception, it's rethrown. */
+        static void parallelScan(KeyStore&,
+                                 unsigned numWorkers,
+                                 bool bySequence,
+                                 const Options&,
+                                 const ScanCallback&);
+
+        /** Returns up to count-1 keys, in ascending order, that split the KeyStore into `count`
+            ranges holding roughly equal numbers of documents. The split is estimated by sampling
+            documents at evenly spaced sequence numbers. */
+        static std::vector<alloc_slice> splitKeys(KeyStore&, unsigned count);
+
         /** Rvalue reference to document, allowing it to be moved (which will clear this copy) */
         Document&& moveDoc()                {return std::move(_doc);}
 
@@ -86,6 +114,8 @@ namespace cbforest {
         int _curDocIndex {0};
         Document _doc;
         bool _skipStep {true};
+        class Prefetcher;
+        std::shared_ptr<Prefetcher> _prefetcher;
 
         friend class KeyStore;
         void setDocIDs(std::vector<std::string> docIDs);
@@ -95,6 +125,7 @@ namespace cbforest {
     private:
         DocEnumerator(KeyStore &store, const Options& options);
         DocEnumerator(const DocEnumerator&) = delete; // no copying allowed
+        void startPrefetch(std::function<DocEnumerator*(KeyStore&)> makeSource);
         void initialPosition();
         bool nextFromArray();
         bool getDoc();
@@ -35,6 +35,17 @@ namespace cbforest {
         srcDoc._doc.bodylen = 0;
     }
 
+    Document& Document::operator= (Document&& srcDoc) {
+        if (&srcDoc != this) {
+            key().free();
+            meta().free();
+            body().free();
+            _doc = srcDoc._doc;
+            memset(&srcDoc._doc, 0, sizeof(srcDoc._doc));
+        }
+        return *this;
+    }
+
     Document::Document(slice key) {
         setKey(key);
     }
@@ -29,6 +29,7 @@ namespace cbforest {
         Document();
         Document(slice key);
         Document(Document&&);
+        Document& operator= (Document&&);
         ~Document();
 
         slice key() const   {return slice(_doc.key, _doc.keylen);}
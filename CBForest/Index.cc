@@ -17,12 +17,19 @@
 #include "Collatable.hh"
 #include "varint.hh"
 #include "LogInternal.hh"
+#include <algorithm>
 
 
 namespace cbforest {
 
     const slice Index::kSpecialValue("*", 1);
 
+    // Number of rows IndexWriter buffers in batched mode before flushing them.
+    static const size_t kMaxPendingRows = 10000;
+
+    // Max memory used by the rows IndexWriter buffers in rebuild mode before flushing them.
+    static const size_t kMaxRebuildRunBytes = 32*1024*1024;
+
     bool KeyRange::isKeyPastEnd(slice key) const {
         return inclusiveEnd ? (key > end) : !(key < end);
     }
@@ -57,7 +64,25 @@ namespace cbforest {
             hash = ((hash << 5) + hash) + value[i];
     }
 
-    void IndexWriter::getKeysForDoc(slice docID, std::vector<Collatable> &keys, uint32_t &hash) {
+    // 64-bit FNV-1a hash of an emitted value. Never returns 0, which is reserved for values whose
+    // fingerprint can't be trusted (kSpecialValue stands for the whole doc, so it always changes.)
+    static uint64_t valueFingerprint(slice value) {
+        if (value == Index::kSpecialValue)
+            return 0;
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < value.size; ++i) {
+            hash ^= value[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash ? hash : 1;
+    }
+
+    // A doc's entry has the emitted keys (preceded by the values' djb2 hash) as its body, and the
+    // values' fingerprints as its meta: 8 big-endian bytes per key. Entries written before
+    // fingerprints were added have no meta, so outFingerprints is left empty for them.
+    void IndexWriter::getKeysForDoc(slice docID, std::vector<Collatable> &keys, uint32_t &hash,
+                                    std::vector<uint64_t> &outFingerprints)
+    {
         Document doc = get(docID);
         if (doc.body().size > 0) {
             CollatableReader reader(doc.body());
@@ -65,21 +90,96 @@ namespace cbforest {
             while (!reader.atEnd()) {
                 keys.push_back( Collatable::withData(reader.read()) );
             }
+            slice meta = doc.meta();
+            if (meta.size == 8 * keys.size()) {
+                outFingerprints.resize(keys.size());
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    uint64_t fp = 0;
+                    for (size_t j = 0; j < 8; ++j)
+                        fp = (fp << 8) | meta[8*i + j];
+                    outFingerprints[i] = fp;
+                }
+            }
         } else {
             hash = kInitialHash;
         }
     }
 
-    void IndexWriter::setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash) {
+    void IndexWriter::setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash,
+                                    const std::vector<uint64_t> &fingerprints)
+    {
         if (keys.size() > 0) {
             CollatableBuilder writer;
             writer << hash;
             for (auto i=keys.begin(); i != keys.end(); ++i)
                 writer << *i;
-            set(docID, writer);
+
+            std::vector<uint8_t> meta;
+            if (8 * fingerprints.size() <= Document::kMaxMetaLength) {
+                meta.resize(8 * fingerprints.size());
+                for (size_t i = 0; i < fingerprints.size(); ++i) {
+                    for (size_t j = 0; j < 8; ++j)
+                        meta[8*i + j] = (uint8_t)(fingerprints[i] >> (56 - 8*j));
+                }
+            }
+            setRow(docID, slice(meta.data(), meta.size()), writer.extractOutput());
+        } else {
+            delRow(docID);
+        }
+    }
+
+    void IndexWriter::setRow(slice key, slice meta, alloc_slice value) {
+        if (!_batched) {
+            set(key, meta, value);
+            return;
+        }
+        PendingRow row;
+        row.key = alloc_slice(key);
+        row.value = value;
+        if (meta.size <= sizeof(row.meta)) {
+            memcpy(row.meta, meta.buf, meta.size);
+            row.metaSize = (uint8_t)meta.size;
         } else {
-            del(docID);
+            row.bigMeta = alloc_slice(meta);
+            row.metaSize = 0;
         }
+        row.deletion = false;
+        _pendingRows.push_back(row);
+        _pendingBytes += sizeof(PendingRow) + row.key.size + row.value.size + row.bigMeta.size;
+    }
+
+    void IndexWriter::delRow(slice key) {
+        if (!_batched) {
+            if (!del(key))
+                Warn("Failed to delete old emitted k/v pair");
+            return;
+        }
+        PendingRow row;
+        row.key = alloc_slice(key);
+        row.metaSize = 0;
+        row.deletion = true;
+        _pendingRows.push_back(row);
+        _pendingBytes += sizeof(PendingRow) + row.key.size;
+    }
+
+    void IndexWriter::flush() {
+        // update() never queues two writes to the same key, but a stable sort guarantees that
+        // if it did, they'd be applied in the order they were made, as in unbatched mode:
+        std::stable_sort(_pendingRows.begin(), _pendingRows.end(),
+                  [](const PendingRow &a, const PendingRow &b) {return a.key < b.key;});
+        for (auto row = _pendingRows.begin(); row != _pendingRows.end(); ++row) {
+            if (row->deletion) {
+                if (!del(row->key))
+                    Warn("Failed to delete old emitted k/v pair");
+            } else {
+                slice meta = row->bigMeta.buf ? (slice)row->bigMeta
+                                              : slice(row->meta, row->metaSize);
+                set(row->key, meta, row->value);
+            }
+        }
+        _pendingRows.clear();
+        _pendingDocs.clear();
+        _pendingBytes = 0;
     }
 
     bool IndexWriter::update(slice docID, sequence docSequence,
@@ -90,14 +190,27 @@ namespace cbforest {
         CollatableBuilder collatableDocID;
         collatableDocID << docID;
 
+        bool hasOldRows = !_rebuilding;
+        if (_batched) {
+            // update() reads the doc's existing rows, so they mustn't have pending changes:
+            alloc_slice docKey(collatableDocID.data());
+            if (!_pendingDocs.insert(docKey).second) {
+                flush();
+                _pendingDocs.insert(docKey);
+                hasOldRows = true;
+            }
+        }
+
         // Metadata of emitted rows contains doc sequence as varint:
         uint8_t metaBuf[10];
         slice meta(metaBuf, PutUVarInt(metaBuf, docSequence));
 
         // Get the previously emitted keys:
         std::vector<Collatable> oldStoredKeys, newStoredKeys;
-        uint32_t oldStoredHash;
-        getKeysForDoc(collatableDocID, oldStoredKeys, oldStoredHash);
+        std::vector<uint64_t> oldFingerprints, newFingerprints;
+        uint32_t oldStoredHash = kInitialHash;
+        if (hasOldRows)
+            getKeysForDoc(collatableDocID, oldStoredKeys, oldStoredHash, oldFingerprints);
 
         // Compute a hash of the values and see whether it's the same as the previous values' hash:
         uint32_t newStoredHash = kInitialHash;
@@ -117,9 +230,11 @@ namespace cbforest {
         auto value = values.begin();
         unsigned emitIndex = 0;
         auto oldKey = oldStoredKeys.begin();
+        std::vector<bool> rewritten(keys.size());   // emit indexes whose rows were set below
+        CollatableBuilder realKey;  // reused for each row
         for (auto key = keys.begin(); key != keys.end(); ++key,++value,++emitIndex) {
             // Create a key for the index db by combining the emitted key, doc ID, and emit#:
-            CollatableBuilder realKey;
+            realKey.reset();
             realKey.beginArray() << *key << collatableDocID;
             if (emitIndex > 0)
                 realKey << emitIndex;
@@ -130,55 +245,72 @@ namespace cbforest {
                 continue;
             }
 
+            uint64_t fingerprint = valueFingerprint(*value);
+            newStoredKeys.push_back(*key);
+            newFingerprints.push_back(fingerprint);
+
             // Is this a key that was previously emitted last time we indexed this document?
             if (keysChanged || oldKey == oldStoredKeys.end() || !(*oldKey == *key)) {
                 // no; note that the set of keys is different
                 keysChanged = true;
             } else {
                 // yes
+                auto oldIndex = oldKey - oldStoredKeys.begin();
                 ++oldKey;
-                if (valuesMightBeUnchanged) {
-                    // read the old row so we can compare the value too:
+                bool unchanged = false;
+                if (!oldFingerprints.empty()) {
+                    // compare the value's fingerprint with the one stored last time:
+                    unchanged = (fingerprint != 0 && fingerprint == oldFingerprints[oldIndex]);
+                } else if (valuesMightBeUnchanged) {
+                    // no fingerprints, so read the old row to compare the value:
                     Document oldRow = get(realKey);
-                    if (oldRow.exists()) {
-                        if (oldRow.body() == *value) {
-                            Log("Old k/v pair (%s, %s) unchanged",
-                                key->toJSON().c_str(), ((std::string)*value).c_str());
-                            continue;  // Value is unchanged, so this is a no-op; skip to next key!
-                        }
-                    } else {
+                    if (oldRow.exists())
+                        unchanged = (oldRow.body() == *value);
+                    else
                         Warn("Old emitted k/v pair unexpectedly missing");
-                    }
+                }
+                if (unchanged) {
+                    Log("Old k/v pair (%s, %s) unchanged",
+                        key->toJSON().c_str(), ((std::string)*value).c_str());
+                    continue;  // Value is unchanged, so this is a no-op; skip to next key!
                 }
                 ++rowsRemoved;  // more like "overwritten"
             }
 
             // Store the key & value:
             Log("**** update: realKey = %s", realKey.toJSON().c_str());
-            set(realKey, meta, *value);
-            newStoredKeys.push_back(*key);
+            setRow(realKey, meta, *value);
+            rewritten[emitIndex] = true;
             ++rowsAdded;
         }
 
-        // If there are any old keys that weren't emitted this time, we need to delete those rows:
+        // If there are any old keys that weren't emitted this time, we need to delete those rows.
+        // (Unless the same key was emitted at the same index, in which case the row was just
+        // overwritten above.)
         for (; oldKey != oldStoredKeys.end(); ++oldKey) {
-            CollatableBuilder realKey;
-            realKey.beginArray() << *oldKey << collatableDocID;
-            auto oldEmitIndex = oldKey - oldStoredKeys.begin();
-            if (oldEmitIndex > 0)
-                realKey << oldEmitIndex;
-            realKey.endArray();
-            bool deleted = del(realKey);
-            if (!deleted) {
-                Warn("Failed to delete old emitted k/v pair");
+            size_t oldEmitIndex = (size_t)(oldKey - oldStoredKeys.begin());
+            bool overwritten = (oldEmitIndex < keys.size() && rewritten[oldEmitIndex]
+                                && keys[oldEmitIndex] == *oldKey);
+            if (!overwritten) {
+                realKey.reset();
+                realKey.beginArray() << *oldKey << collatableDocID;
+                if (oldEmitIndex > 0)
+                    realKey << oldEmitIndex;
+                realKey.endArray();
+                delRow(realKey);
             }
             ++rowsRemoved;
             keysChanged = true;
         }
 
-        // Store the keys that were emitted for this doc, and the hash of the values:
-        if (keysChanged)
-            setKeysForDoc(collatableDocID, newStoredKeys, newStoredHash);
+        // Store the keys that were emitted for this doc, and the hash and fingerprints of the
+        // values (which have to be updated whenever a value changes, too):
+        if (keysChanged || rowsAdded > 0)
+            setKeysForDoc(collatableDocID, newStoredKeys, newStoredHash, newFingerprints);
+
+        if (_rebuilding ? (_pendingBytes >= kMaxRebuildRunBytes)
+                        : (_pendingRows.size() >= kMaxPendingRows))
+            flush();
 
         if (rowsRemoved==0 && rowsAdded==0)
             return false;
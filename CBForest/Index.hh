@@ -19,6 +19,8 @@
 #include "DocEnumerator.hh"
 #include "Collatable.hh"
 #include <atomic>
+#include <set>
+#include <vector>
 
 namespace cbforest {
     
@@ -87,14 +89,48 @@ namespace cbforest {
                     const std::vector<alloc_slice> &values,
                     uint64_t &rowCount);
 
+        /** In batched mode, update() doesn't write rows immediately: it buffers them, and flush()
+            sorts them by key and writes them in that order, so the B-tree is updated sequentially
+            instead of at random. The buffer is flushed automatically when it fills up. Any rows
+            still buffered when the writer is destroyed are discarded. */
+        void setBatched(bool batched)           {_batched = batched;}
+
+        /** Rebuild mode is for filling an index that starts out empty, with each document
+            indexed at most once. update() skips looking up a document's previously emitted rows,
+            since there aren't any, and rows are batched in much larger runs, bounded by the
+            memory they use rather than by their count. Implies batched mode. */
+        void setRebuilding(bool rebuilding)     {_rebuilding = rebuilding;
+                                                 if (rebuilding) _batched = true;}
+
+        /** Writes the rows buffered in batched mode. */
+        void flush();
+
     private:
-        void getKeysForDoc(slice docID, std::vector<Collatable> &outKeys, uint32_t &outHash);
-        void setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash);
+        struct PendingRow {
+            alloc_slice key;
+            alloc_slice value;
+            uint8_t     meta[10];       // Meta, if it fits (e.g. an index row's varint sequence)
+            uint8_t     metaSize;
+            alloc_slice bigMeta;        // Meta that doesn't fit in meta[]
+            bool        deletion;
+        };
+
+        void getKeysForDoc(slice docID, std::vector<Collatable> &outKeys, uint32_t &outHash,
+                           std::vector<uint64_t> &outFingerprints);
+        void setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash,
+                           const std::vector<uint64_t> &fingerprints);
+        void setRow(slice key, slice meta, alloc_slice value);
+        void delRow(slice key);
 
         friend class Index;
         friend class MapReduceIndex;
 
         Index *_index;
+        bool _batched {false};
+        bool _rebuilding {false};
+        std::vector<PendingRow> _pendingRows;
+        size_t _pendingBytes {0};               // Approximate memory used by _pendingRows
+        std::set<alloc_slice> _pendingDocs;     // Collatable docIDs with rows in _pendingRows
     };
 
 
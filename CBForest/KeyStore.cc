@@ -16,6 +16,7 @@
 #include "KeyStore.hh"
 #include "Document.hh"
 #include "LogInternal.hh"
+#include <algorithm>
 
 namespace cbforest {
 
@@ -84,6 +85,25 @@ namespace cbforest {
             return checkGet(fdb_get(_handle, doc));
     }
 
+    std::vector<Document> KeyStore::get(const std::vector<slice> &keys,
+                                        contentOptions options) const
+    {
+        std::vector<Document> docs;
+        docs.reserve(keys.size());
+        std::vector<size_t> order;
+        order.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            docs.emplace_back(keys[i]);
+            order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+            return keys[a] < keys[b];
+        });
+        for (size_t i : order)
+            read(docs[i], options);
+        return docs;
+    }
+
     Document KeyStore::getByOffset(uint64_t offset, sequence seq) const {
         Document doc;
         doc._doc.offset = offset;
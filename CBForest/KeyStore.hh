@@ -12,6 +12,7 @@
 #include "Error.hh"
 #include "forestdb.h"
 #include "slice.hh"
+#include <vector>
 
 namespace cbforest {
 
@@ -47,6 +48,12 @@ namespace cbforest {
         Document get(sequence, contentOptions = kDefaultContent) const;
         bool read(Document&, contentOptions = kDefaultContent) const; // key must already be set
 
+        /** Reads multiple documents. The results are in the same order as the keys, but the keys
+            are looked up in sorted order, which makes for more local B-tree access. Documents
+            that don't exist are returned with only their keys set. */
+        std::vector<Document> get(const std::vector<slice> &keys,
+                                  contentOptions = kDefaultContent) const;
+
         Document getByOffset(uint64_t offset, sequence) const;
         Document getByOffsetNoErrors(uint64_t offset, sequence) const;  // doesn't throw or log
 
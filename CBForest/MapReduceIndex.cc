@@ -19,6 +19,12 @@
 #include "Tokenizer.hh"
 #include "LogInternal.hh"
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace cbforest {
 
@@ -135,6 +141,15 @@ namespace cbforest {
         _stateReadAt = 0;
     }
 
+    // True if the store contains nothing at all, not even a saved state.
+    bool MapReduceIndex::isEmpty() const {
+        auto options = DocEnumerator::Options::kDefault;
+        options.limit = 1;
+        options.contentOptions = KeyStore::kMetaOnly;
+        DocEnumerator e(_store, slice::null, slice::null, options);
+        return !e.next();
+    }
+
     void MapReduceIndex::erase() {
         Debug("MapReduceIndex: Erasing");
         _store.erase();
@@ -325,10 +340,17 @@ namespace cbforest {
          index(idx),
          _documentType(index->documentType()),
          _transaction(t)
-        { }
+        {
+            setBatched(true);
+            // An index being built from scratch has no old rows to look up or replace:
+            if (index->_lastSequenceIndexed == 0 && index->isEmpty())
+                setRebuilding(true);
+        }
 
         MapReduceIndex* const index;
 
+        using IndexWriter::flush;
+
         bool shouldIndexDocument(const Document& doc) const {
             return doc.sequence() > index->_lastSequenceIndexed;
         }
@@ -337,33 +359,44 @@ namespace cbforest {
             return _documentType.buf == NULL || _documentType == docType;
         }
         
-        // Writes the given rows to the index.
+        // Advances the index's last-indexed sequence to the document's. Returns false if the
+        // index has already indexed this sequence, in which case the doc should be skipped.
+        bool claimDocument(sequence docSequence) {
+            if (docSequence <= index->_lastSequenceIndexed)
+                return false;
+            index->_lastSequenceIndexed = docSequence;
+            return true;
+        }
+
+        // Writes the given rows to the index. The document must have been claimed already.
         bool indexDocument(slice docID,
                            sequence docSequence,
                            const std::vector<Collatable> &keys,
                            const std::vector<alloc_slice> &values)
         {
-            if (docSequence <= index->_lastSequenceIndexed)
-                return false;
             _emitter.reset();
             for (unsigned i = 0; i < keys.size(); ++i)
                 _emitter.emit(keys[i], values[i]);
 
-            index->_lastSequenceIndexed = docSequence;
             if (update(docID, docSequence, _emitter.keys, _emitter.values, index->_rowCount)) {
-                index->_lastSequenceChangedAt = index->_lastSequenceIndexed;
+                index->_lastSequenceChangedAt = docSequence;
                 return true;
             }
             return false;
         }
 
+        // Saves the index state and commits, throwing if that fails; or else rolls back.
         void finish(bool success) {
-            if (success)
+            if (success) {
                 index->saveState(*_transaction);
-            else
-                _transaction->abort();
+                _transaction->commit();
+            } else {
+                _transaction->abort();      // rolled back when the writer is deleted
+            }
         }
 
+        IndexWriterThread* thread {nullptr};   // Writes rows in parallel mode
+
     private:
         alloc_slice const _documentType;
         Emitter _emitter;
@@ -371,6 +404,87 @@ namespace cbforest {
     };
 
     
+#pragma mark - INDEX WRITER THREAD:
+
+
+    // Runs the index writes for the views in one index database, in order, on a background
+    // thread. Used by MapReduceIndexer in parallel mode.
+    class IndexWriterThread {
+    public:
+        IndexWriterThread()
+        :_thread([this]{run();})
+        { }
+
+        // Discards any unwritten tasks (they're only left over if indexing is being aborted.)
+        ~IndexWriterThread() {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _tasks.clear();
+                _stopping = true;
+            }
+            _cond.notify_all();
+            _thread.join();
+        }
+
+        // Queues a task; blocks while the queue is full. Rethrows an earlier task's exception.
+        void enqueue(std::function<void()> task) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [&]{return _tasks.size() < kMaxQueuedTasks || _error;});
+            if (_error)
+                std::rethrow_exception(_error);
+            _tasks.push_back(std::move(task));
+            _cond.notify_all();
+        }
+
+        // Waits until all queued tasks have run. Rethrows a task's exception.
+        void flush() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [&]{return (_tasks.empty() && !_busy) || _error;});
+            if (_error)
+                std::rethrow_exception(_error);
+        }
+
+    private:
+        static const size_t kMaxQueuedTasks = 256;
+
+        void run() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                _cond.wait(lock, [&]{return !_tasks.empty() || _stopping;});
+                if (_tasks.empty())
+                    return;
+                auto task = std::move(_tasks.front());
+                _tasks.pop_front();
+                _busy = true;
+                lock.unlock();
+
+                std::exception_ptr error;
+                try {
+                    task();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                lock.lock();
+                _busy = false;
+                if (error && !_error) {
+                    _error = error;
+                    _tasks.clear();     // the index transaction will be aborted anyway
+                }
+                _cond.notify_all();
+            }
+        }
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<std::function<void()>> _tasks;
+        std::exception_ptr _error;
+        bool _busy {false};
+        bool _stopping {false};
+        std::thread _thread;                // must come last, since it starts running run()
+    };
+
+
 #pragma mark - MAP-REDUCE INDEXER
 
     
@@ -410,12 +524,20 @@ namespace cbforest {
 
 
     MapReduceIndexer::~MapReduceIndexer() {
+        // Stop the threads first; finished() has already flushed them if necessary.
+        for (auto thread = _threads.begin(); thread != _threads.end(); ++thread)
+            delete *thread;
         for (auto writer = _writers.begin(); writer != _writers.end(); ++writer) {
-            (*writer)->finish(_finished);
+            if (!_finished)
+                (*writer)->finish(false);
             delete *writer;
         }
     }
 
+    sequence MapReduceIndexer::lastSequenceIndexed(unsigned viewNumber) const {
+        return _writers[viewNumber]->index->_lastSequenceIndexed;
+    }
+
     bool MapReduceIndexer::shouldMapDocIntoView(const Document &doc, unsigned viewNumber) {
         return _writers[viewNumber]->shouldIndexDocument(doc);
     }
@@ -424,22 +546,76 @@ namespace cbforest {
         return _writers[viewNumber]->shouldIndexDocumentType(docType);
     }
 
+    void MapReduceIndexer::finished() {
+        // Write the rows the writers have batched up, on their threads in parallel mode:
+        for (auto i = _writers.begin(); i != _writers.end(); ++i) {
+            MapReduceIndexWriter *writer = *i;
+            if (writer->thread)
+                writer->thread->enqueue([=]() {writer->flush();});
+            else
+                writer->flush();
+        }
+        for (auto thread = _threads.begin(); thread != _threads.end(); ++thread)
+            (*thread)->flush();
+        // Then commit each index, so a failure is reported to the caller:
+        for (auto writer = _writers.begin(); writer != _writers.end(); ++writer)
+            (*writer)->finish(true);
+        _finished = true;
+    }
+
     void MapReduceIndexer::emitDocIntoView(slice docID,
                                            sequence docSequence,
                                            unsigned viewNumber,
                                            const std::vector<Collatable> &keys,
                                            const std::vector<alloc_slice> &values)
     {
-        _writers[viewNumber]->indexDocument(docID, docSequence, keys, values);
+        indexDocument(_writers[viewNumber], docID, docSequence, keys, values);
     }
 
     void MapReduceIndexer::skipDoc(slice docID, sequence docSequence) {
         for (auto i = _writers.begin(); i != _writers.end(); ++i)
-            (*i)->indexDocument(docID, docSequence, _noKeys, _noValues);
+            indexDocument(*i, docID, docSequence, _noKeys, _noValues);
     }
 
     void MapReduceIndexer::skipDocInView(slice docID, sequence docSequence, unsigned viewNumber) {
-        _writers[viewNumber]->indexDocument(docID, docSequence, _noKeys, _noValues);
+        indexDocument(_writers[viewNumber], docID, docSequence, _noKeys, _noValues);
+    }
+
+    void MapReduceIndexer::indexDocument(MapReduceIndexWriter *writer,
+                                         slice docID,
+                                         sequence docSequence,
+                                         const std::vector<Collatable> &keys,
+                                         const std::vector<alloc_slice> &values)
+    {
+        // The sequence check happens on this thread, so shouldMapDocIntoView() stays accurate:
+        if (!writer->claimDocument(docSequence))
+            return;
+        if (!_parallel) {
+            writer->indexDocument(docID, docSequence, keys, values);
+            return;
+        }
+        if (_threads.empty())
+            startThreads();
+        alloc_slice docIDCopy(docID);
+        writer->thread->enqueue([=]() {
+            writer->indexDocument(docIDCopy, docSequence, keys, values);
+        });
+    }
+
+    // Creates one IndexWriterThread per index database. Views in the same database share a
+    // thread, since a Database handle can't be used by two threads at once.
+    void MapReduceIndexer::startThreads() {
+        std::map<Database*, IndexWriterThread*> threadForDB;
+        for (auto writer = _writers.begin(); writer != _writers.end(); ++writer) {
+            IndexWriterThread* &thread = threadForDB[(*writer)->index->database()];
+            if (!thread) {
+                thread = new IndexWriterThread();
+                _threads.push_back(thread);
+            }
+            (*writer)->thread = thread;
+        }
+        Debug("MapReduceIndexer: Writing %zu views on %zu threads",
+              _writers.size(), _threads.size());
     }
 
 }
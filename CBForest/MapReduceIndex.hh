@@ -25,6 +25,7 @@
 namespace cbforest {
 
     class MapReduceIndexWriter;
+    class IndexWriterThread;
 
     /** An Index that uses a MapFn to index the documents of another KeyStore. */
     class MapReduceIndex : public Index {
@@ -68,6 +69,7 @@ namespace cbforest {
 
     private:
         bool checkForPurge();
+        bool isEmpty() const;
         void invalidate();
         void deleted();
         void saveState(Transaction& t);
@@ -97,8 +99,18 @@ namespace cbforest {
         /** If set, indexing will only occur if this index needs to be updated. */
         void triggerOnIndex(MapReduceIndex* index)  {_triggerIndex = index;}
 
-        /** Returns true if indexing completed successfully. */
-        void finished()                             {_finished = true;}
+        /** If enabled, emitted rows are written to each view's index on a background thread,
+            one per index database, so the writes to different views happen concurrently.
+            (Each view's index is still updated in the same order as with serial indexing.)
+            Must be called before the first row is emitted. */
+        void setParallel(bool parallel)             {_parallel = parallel;}
+
+        /** Marks indexing as completed successfully, and commits the indexes.
+            This first writes the index rows that have been batched up (see
+            IndexWriter::setBatched); in parallel mode it waits for the pending writes, and
+            rethrows any error that occurred while writing them. Throws if a commit fails.
+            If this isn't called, the indexes are rolled back when the indexer is deleted. */
+        void finished();
 
         /** Determines at which sequence indexing should start.
             Returns UINT64_MAX if no re-indexing is necessary. */
@@ -108,6 +120,13 @@ namespace cbforest {
             or NULL if all documents should be mapped. */
         std::set<slice> *documentTypes();
 
+        /** The number of views (indexes) being updated. */
+        unsigned viewCount() const                  {return (unsigned)_writers.size();}
+
+        /** The last source sequence that the given view has indexed so far, including documents
+            emitted into it during this indexing session. */
+        sequence lastSequenceIndexed(unsigned viewNumber) const;
+
         /** Returns true if the given document should be indexed by the given view,
             i.e. if the view has not yet indexed this doc's sequence. */
         bool shouldMapDocIntoView(const Document &doc, unsigned viewNumber);
@@ -132,9 +151,18 @@ namespace cbforest {
         void skipDocInView(slice docID, sequence docSequence, unsigned viewNumber);
 
     private:
+        void startThreads();
+        void indexDocument(MapReduceIndexWriter*,
+                           slice docID,
+                           sequence docSequence,
+                           const std::vector<Collatable> &keys,
+                           const std::vector<alloc_slice> &values);
+
         std::vector<MapReduceIndexWriter*> _writers;
+        std::vector<IndexWriterThread*> _threads;
         MapReduceIndex* _triggerIndex {nullptr};
         sequence _latestDbSequence {0};
+        bool _parallel {false};
         bool _finished {false};
         bool _allDocTypes {false};
         std::set<slice> _docTypes;
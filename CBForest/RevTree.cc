@@ -33,13 +33,38 @@
 
 namespace cbforest {
 
-    // Layout of revision rev in encoded form. Tree is a sequence of these followed by a 32-bit zero.
-    // Revs are stored in decending priority, with the current leaf rev(s) coming first.
+    // Trees with more revs than this get a hash index for looking up revIDs.
+    static const size_t kMinIndexedRevs = 32;
+
+    // Encoded trees in the v2 format start with this byte. (Trees in the legacy format start
+    // with the big-endian size of their first rev, whose high byte can't be this large.)
+    static const uint8_t kTreeFormatV2 = 0xF2;
+
+    // Layout of the compact (v2) encoded form: kTreeFormatV2, a varint rev count, then the revs in
+    // decending priority, with the current leaf rev(s) coming first. Each rev is:
+    //   uint8      flags
+    //   uint8      revIDLen
+    //   char       revID[revIDLen]
+    //   if HasParent flag:
+    //      zvarint parentIndex - index
+    //   zvarint    sequence - sequence of previous rev
+    //   if HasData flag:
+    //      varint  body_size
+    //      char    data[body_size]
+    //   else if HasBodyOffset flag:
+    //      zvarint oldBodyOffset - oldBodyOffset of previous rev that had one
+    // ("zvarint" is a zigzag-encoded signed varint.) There are no per-rev sizes, since revs are
+    // only ever decoded in order; the running state for the deltas is a Revision::DeltaState.
+
+    // Layout of a rev in the legacy (v1) encoded form, which encode() writes by default. The tree
+    // is a sequence of these followed by a 32-bit zero.
     class RawRevision {
     public:
         // Private RevisionFlags bits used in encoded form:
         enum : uint8_t {
-            kPublicPersistentFlags = (Revision::kLeaf | Revision::kDeleted | Revision::kHasAttachments),
+            kPublicPersistentFlags = (Revision::kLeaf | Revision::kDeleted |
+                                      Revision::kHasAttachments | Revision::kExternalBody),
+            kHasParent     = 0x20,  /**< Does this rev have a parent? (v2 only) */
             kHasBodyOffset = 0x40,  /**< Does this raw rev have a file position (oldBodyOffset)? */
             kHasData       = 0x80,  /**< Does this raw rev contain JSON data? */
         };
@@ -64,14 +89,47 @@ namespace cbforest {
         const RawRevision *next() const {
             return (const RawRevision*)offsetby(this, ntohl(size));
         }
+    };
 
-        unsigned count() const {
-            unsigned count = 0;
-            for (const RawRevision *rev = this; rev->isValid(); rev = rev->next())
-                ++count;
-            return count;
+
+    static inline uint64_t zigzag(int64_t n) {
+        return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+    }
+
+    static inline int64_t unzigzag(uint64_t n) {
+        return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+    }
+
+    // Writes a varint to dst and advances it; or if dst is NULL, just measures.
+    static inline size_t putVarInt(uint8_t* &dst, uint64_t n) {
+        if (!dst)
+            return SizeOfVarInt(n);
+        size_t len = PutUVarInt(dst, n);
+        dst += len;
+        return len;
+    }
+
+    // Copies bytes to dst and advances it; or if dst is NULL, just measures.
+    static inline size_t putBytes(uint8_t* &dst, slice bytes) {
+        if (dst) {
+            memcpy(dst, bytes.buf, bytes.size);
+            dst += bytes.size;
         }
-    };
+        return bytes.size;
+    }
+
+    static inline uint64_t readVarInt(slice &src) {
+        uint64_t n;
+        if (!ReadUVarInt(&src, &n))
+            throw error(error::CorruptRevisionData);
+        return n;
+    }
+
+    static inline slice readBytes(slice &src, size_t size) {
+        if (size > src.size)
+            throw error(error::CorruptRevisionData);
+        return src.read(size);
+    }
 
 
     RevTree::RevTree(slice raw_tree, sequence seq, uint64_t docOffset)
@@ -80,31 +138,64 @@ namespace cbforest {
         decode(raw_tree, seq, docOffset);
     }
 
+    // Only validates the tree's header/structure; the revs are parsed on demand by decodeRevs().
     void RevTree::decode(cbforest::slice raw_tree, sequence seq, uint64_t docOffset) {
-        const RawRevision *rawRev = (const RawRevision*)raw_tree.buf;
-        unsigned count = rawRev->count();
+        size_t count = 0;
+        _unread = raw_tree;
+        _legacyFormat = (raw_tree.size == 0 || raw_tree[0] != kTreeFormatV2);
+        if (_legacyFormat) {
+            const RawRevision *end;
+            for (end = (const RawRevision*)raw_tree.buf; end->isValid(); end = end->next())
+                ++count;
+            if ((uint8_t*)end != (uint8_t*)raw_tree.end() - sizeof(uint32_t)) {
+                throw error(error::CorruptRevisionData);
+            }
+        } else {
+            _unread.moveStart(1);
+            count = (size_t)readVarInt(_unread);
+        }
         if (count > UINT16_MAX)
             throw error(error::CorruptRevisionData);
         _bodyOffset = docOffset;
-        _revs.resize(count);
-        auto rev = _revs.begin();
-        for (; rawRev->isValid(); rawRev = rawRev->next()) {
-            rev->read(rawRev);
-            if (rev->sequence == 0)
-                rev->sequence = seq;
-            rev->owner = this;
-            rev++;
-        }
-        if ((uint8_t*)rawRev != (uint8_t*)raw_tree.end() - sizeof(uint32_t)) {
-            throw error(error::CorruptRevisionData);
+        _revs.clear();
+        _revs.reserve(count);   // Ensures Revision pointers stay valid as more revs are decoded
+        _revIndex.clear();
+        _handleIndex.clear();
+        _sorted = true;         // trees are always sorted before being encoded
+        _unreadCount = count;
+        _unreadSequence = seq;
+        _unreadState = {};
+        _encoded = _legacyFormat ? slice::null : raw_tree;
+        _spliceable = !_legacyFormat;
+    }
+
+    // Decodes revs from the encoded tree until there are at least `count` in _revs.
+    void RevTree::decodeRevs(size_t count) const {
+        auto self = const_cast<RevTree*>(this);
+        while (_revs.size() < count && _unreadCount > 0) {
+            Revision rev;
+            if (_legacyFormat) {
+                auto rawRev = (const RawRevision*)_unread.buf;
+                rev.read(rawRev);
+                self->_unread.moveStart((uint8_t*)rawRev->next() - (uint8_t*)rawRev);
+            } else {
+                rev.read(self->_unread, self->_unreadState);
+                if (_unreadCount == 1 && _unread.size > 0)
+                    throw error(error::CorruptRevisionData);    // trailing garbage
+            }
+            if (rev.sequence == 0)
+                rev.sequence = _unreadSequence;
+            rev.owner = this;
+            rev.handle = (uint16_t)_revs.size();
+            self->_revs.push_back(rev);
+            --self->_unreadCount;
         }
     }
 
     alloc_slice RevTree::encode() {
+        decodeAll();
         sort();
 
-        // Allocate output buffer:
-        size_t size = sizeof(uint32_t);  // start with space for trailing 0 size
         for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
             if (rev->body.size > 0 && !(rev->isLeaf() || rev->isNew())) {
                 // Prune body of an already-saved rev that's no longer a leaf:
@@ -113,9 +204,44 @@ namespace cbforest {
                 CBFAssert(_bodyOffset > 0);
                 rev->oldBodyOffset = _bodyOffset;
             }
-            size += rev->sizeToWrite();
         }
 
+        if (!_encodeV2) {
+            _spliceable = false;
+            return encodeV1();
+        }
+
+        alloc_slice result = encodeSpliced();
+        _spliceable = false;    // _encoded no longer matches what's saved
+        if (result.buf)
+            return result;
+
+        // Measure the output:
+        uint8_t *dst = NULL;
+        Revision::DeltaState state = {};
+        size_t size = 1 + putVarInt(dst, _revs.size());
+        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev)
+            size += rev->write(dst, state);
+
+        // Write the header and the revs:
+        result = alloc_slice(size);
+        dst = (uint8_t*)result.buf;
+        *dst++ = kTreeFormatV2;
+        putVarInt(dst, _revs.size());
+        state = {};
+        for (auto src = _revs.begin(); src != _revs.end(); ++src) {
+            src->write(dst, state);
+        }
+        CBFAssert(dst == result.end());
+        return result;
+    }
+
+    // Writes the tree in the legacy (v1) form, which all versions of CBForest can read.
+    alloc_slice RevTree::encodeV1() const {
+        size_t size = sizeof(uint32_t);  // start with space for trailing 0 size
+        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev)
+            size += rev->sizeToWrite();
+
         alloc_slice result(size);
 
         // Write the raw revs:
@@ -128,6 +254,152 @@ namespace cbforest {
         return result;
     }
 
+    // Fast path for encode(), for the usual case where the only changes since decoding were
+    // adding a child to the current revision of a conflict-free tree, and maybe pruning the
+    // oldest revs. The revs then keep their order (shifted down one), and since parent indexes
+    // are encoded relative to the rev's own index, most of them encode exactly as before. So
+    // this re-encodes only the revs whose bytes change -- the new one, its parent, the ones
+    // whose delta bases changed, and the new root -- and copies the rest from _encoded.
+    // Only v2 trees can be spliced, so this is only used when setEncodeV2(true) was called and
+    // the tree was decoded from v2; a tree saved as v1 is always encoded in full.
+    // Returns a null slice if the tree doesn't qualify.
+    alloc_slice RevTree::encodeSpliced() {
+        size_t n = _revs.size();
+        if (!_spliceable || n < 2 || !_revs[0].isNew() || _revs[0].parentIndex != 1)
+            return alloc_slice();
+        for (size_t i = 1; i < n; ++i) {
+            const Revision &rev = _revs[i];
+            size_t parent = (i + 1 < n) ? i + 1 : (size_t)Revision::kNoParent;
+            if (rev.isLeaf() || rev.isNew() || rev.parentIndex != parent)
+                return alloc_slice();
+        }
+
+        slice src = _encoded;
+        src.moveStart(1);
+        size_t oldCount = (size_t)readVarInt(src);
+        if (n - 1 > oldCount)
+            return alloc_slice();
+        bool pruned = (n - 1 < oldCount);
+
+        // Each piece of the output is either a rev to encode, or bytes to copy from _encoded
+        // along with the encoder state after them:
+        struct Piece {
+            const Revision *rev;
+            slice bytes;
+            Revision::DeltaState stateAfter;
+        };
+        std::vector<Piece> pieces;
+        pieces.reserve(n);
+
+        uint8_t *measure = NULL;
+        Revision::DeltaState inState = {}, outState = {};
+        size_t size = 1 + putVarInt(measure, n);
+        pieces.push_back({&_revs[0], slice(), {}});
+        size += _revs[0].write(measure, outState);
+        for (size_t i = 1; i < n; ++i) {
+            // _revs[i] was old rev i-1:
+            Revision::DeltaState stateBefore = inState;
+            const void *start = src.buf;
+            Revision oldRev;
+            oldRev.read(src, inState);
+            if (oldRev.revID != _revs[i].revID)
+                return alloc_slice();
+            bool unchanged = (i >= 2                    // _revs[1] just stopped being a leaf
+                              && oldRev.sequence != 0   // 0 means it got the doc's sequence
+                              && oldRev.body.size == 0  // else encode() pruned the body
+                              && !(pruned && i == n - 1)    // new root has lost its parent
+                              && outState.sequence == stateBefore.sequence
+                              && outState.bodyOffset == stateBefore.bodyOffset);
+            if (unchanged) {
+                if (pieces.back().rev == NULL)
+                    pieces.back().bytes.setEnd(src.buf);
+                else
+                    pieces.push_back({NULL, slice(start, src.buf), {}});
+                size += (uint8_t*)src.buf - (uint8_t*)start;
+                outState = inState;
+                outState.index = (unsigned)i + 1;
+                pieces.back().stateAfter = outState;
+            } else {
+                pieces.push_back({&_revs[i], slice(), {}});
+                size += _revs[i].write(measure, outState);
+            }
+        }
+
+        alloc_slice result(size);
+        uint8_t *dst = (uint8_t*)result.buf;
+        *dst++ = kTreeFormatV2;
+        putVarInt(dst, n);
+        outState = {};
+        for (auto piece = pieces.begin(); piece != pieces.end(); ++piece) {
+            if (piece->rev) {
+                piece->rev->write(dst, outState);
+            } else {
+                putBytes(dst, piece->bytes);
+                outState = piece->stateAfter;
+            }
+        }
+        CBFAssert(dst == result.end());
+        return result;
+    }
+
+    // Writes the rev in v2 form to dst (if non-NULL), advancing dst. Returns the encoded size.
+    size_t Revision::write(uint8_t* &dst, DeltaState &state) const {
+        uint8_t dstFlags = this->flags & RawRevision::kPublicPersistentFlags;
+        if (this->parentIndex != kNoParent)
+            dstFlags |= RawRevision::kHasParent;
+        if (this->body.size > 0)
+            dstFlags |= RawRevision::kHasData;
+        else if (this->oldBodyOffset > 0)
+            dstFlags |= RawRevision::kHasBodyOffset;
+        if (dst) {
+            *dst++ = dstFlags;
+            *dst++ = (uint8_t)this->revID.size;
+        }
+        size_t size = 2 + putBytes(dst, this->revID);
+
+        if (dstFlags & RawRevision::kHasParent)
+            size += putVarInt(dst, zigzag((int64_t)this->parentIndex - state.index));
+        size += putVarInt(dst, zigzag(this->sequence - state.sequence));
+        if (dstFlags & RawRevision::kHasData) {
+            size += putVarInt(dst, this->body.size);
+            size += putBytes(dst, this->body);
+        } else if (dstFlags & RawRevision::kHasBodyOffset) {
+            size += putVarInt(dst, zigzag(this->oldBodyOffset - state.bodyOffset));
+            state.bodyOffset = this->oldBodyOffset;
+        }
+
+        ++state.index;
+        state.sequence = this->sequence;
+        return size;
+    }
+
+    // Reads a rev in v2 form from src, advancing it.
+    void Revision::read(slice &src, DeltaState &state) {
+        uint8_t srcFlags = readBytes(src, 1)[0];
+        size_t revIDLen = readBytes(src, 1)[0];
+        slice revIDBytes = readBytes(src, revIDLen);
+        this->revID.buf = revIDBytes.buf;
+        this->revID.size = revIDBytes.size;
+        this->flags = (Flags)(srcFlags & RawRevision::kPublicPersistentFlags);
+
+        this->parentIndex = kNoParent;
+        if (srcFlags & RawRevision::kHasParent)
+            this->parentIndex = (uint16_t)(state.index + unzigzag(readVarInt(src)));
+        this->sequence = state.sequence + unzigzag(readVarInt(src));
+
+        this->body = slice();
+        this->oldBodyOffset = 0;
+        if (srcFlags & RawRevision::kHasData) {
+            this->body = readBytes(src, (size_t)readVarInt(src));
+        } else if (srcFlags & RawRevision::kHasBodyOffset) {
+            this->oldBodyOffset = state.bodyOffset + unzigzag(readVarInt(src));
+            state.bodyOffset = this->oldBodyOffset;
+        }
+
+        ++state.index;
+        state.sequence = this->sequence;
+    }
+
     size_t Revision::sizeToWrite() const {
         size_t size = offsetof(RawRevision, revID) + this->revID.size + SizeOfVarInt(this->sequence);
         if (this->body.size > 0)
@@ -137,6 +409,7 @@ namespace cbforest {
         return size;
     }
 
+    // Writes the rev in the legacy (v1) form.
     RawRevision* Revision::write(RawRevision* dst, uint64_t bodyOffset) const {
         size_t revSize = this->sizeToWrite();
         dst->size = htonl((uint32_t)revSize);
@@ -162,6 +435,7 @@ namespace cbforest {
         return (RawRevision*)offsetby(dst, revSize);
     }
 
+    // Reads a rev in the legacy (v1) form.
     void Revision::read(const RawRevision *src) {
         const void* end = src->next();
         this->revID.buf = (char*)src->revID;
@@ -205,39 +479,126 @@ namespace cbforest {
     const Revision* RevTree::currentRevision() {
         CBFAssert(!_unknown);
         sort();
-        return _revs.size() == 0 ? NULL : &_revs[0];
+        return size() == 0 ? NULL : get(0);
     }
 
     const Revision* RevTree::get(unsigned index) const {
         CBFAssert(!_unknown);
-        CBFAssert(index < _revs.size());
+        CBFAssert(index < size());
+        decodeRevs(index + 1);
         return &_revs[index];
     }
 
+    // The lookups below decode only as far as the matching rev.
+
     const Revision* RevTree::get(revid revID) const {
-        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
-            if (rev->revID == revID)
-                return &*rev;
+        if (size() > kMinIndexedRevs) {
+            if (_revIndex.empty())
+                buildRevIndex();
+            return findInRevIndex(revID);
+        }
+        for (unsigned i = 0; i < size(); ++i) {
+            decodeRevs(i + 1);
+            if (_revs[i].revID == revID)
+                return &_revs[i];
         }
         CBFAssert(!_unknown);
         return NULL;
     }
 
     const Revision* RevTree::getBySequence(sequence seq) const {
-        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
-            if (rev->sequence == seq)
-                return &*rev;
+        for (unsigned i = 0; i < size(); ++i) {
+            decodeRevs(i + 1);
+            if (_revs[i].sequence == seq)
+                return &_revs[i];
         }
         CBFAssert(!_unknown);
         return NULL;
     }
 
+#pragma mark - REVID INDEX:
+
+    // _revIndex is an open-addressing hash table of indexes into _revs, keyed by revID, with
+    // kNoParent marking empty slots. It's kept at most half full, and is built on demand.
+
+    void RevTree::buildRevIndex() const {
+        decodeAll();
+        auto self = const_cast<RevTree*>(this);
+        size_t capacity = 2 * kMinIndexedRevs;
+        while (capacity < 2 * _revs.size())
+            capacity *= 2;
+        self->_revIndex.assign(capacity, uint16_t(Revision::kNoParent));
+        for (unsigned i = 0; i < _revs.size(); ++i)
+            self->addToRevIndex(i);
+    }
+
+    void RevTree::addToRevIndex(unsigned revIndex) {
+        size_t mask = _revIndex.size() - 1;
+        size_t slot = _revs[revIndex].revID.hash() & mask;
+        while (_revIndex[slot] != Revision::kNoParent)
+            slot = (slot + 1) & mask;
+        _revIndex[slot] = (uint16_t)revIndex;
+    }
+
+    const Revision* RevTree::findInRevIndex(revid revID) const {
+        size_t mask = _revIndex.size() - 1;
+        for (size_t slot = revID.hash() & mask;
+                    _revIndex[slot] != Revision::kNoParent;
+                    slot = (slot + 1) & mask) {
+            const Revision &rev = _revs[_revIndex[slot]];
+            if (rev.revID == revID)
+                return &rev;
+        }
+        return NULL;
+    }
+
+
+#pragma mark - HANDLES:
+
+    // A RevHandle's id is the index its rev had when it was decoded or inserted. Until the array
+    // is first reordered, that's still its index, so _handleIndex stays empty; after that it maps
+    // each id to the current index (or kNoParent if the rev is gone.)
+
+    RevTree::RevHandle RevTree::handleOf(const Revision *rev) const {
+        if (!rev)
+            return RevHandle();
+        CBFAssert(rev->owner == this);
+        return RevHandle(rev->handle);
+    }
+
+    const Revision* RevTree::get(RevHandle h) const {
+        if (!h)
+            return NULL;
+        unsigned index = h.id;
+        if (!_handleIndex.empty())
+            index = (h.id < _handleIndex.size()) ? _handleIndex[h.id] : Revision::kNoParent;
+        if (index >= size())
+            return NULL;
+        return get(index);
+    }
+
+    // Called when the revs are rearranged; oldToNew maps old indexes to new ones (or kNoParent.)
+    void RevTree::remapHandles(const std::vector<uint16_t> &oldToNew) {
+        if (_handleIndex.empty()) {
+            _handleIndex.resize(oldToNew.size());
+            for (uint16_t i = 0; i < oldToNew.size(); ++i)
+                _handleIndex[i] = i;
+        }
+        for (auto h = _handleIndex.begin(); h != _handleIndex.end(); ++h) {
+            if (*h != Revision::kNoParent)
+                *h = oldToNew[*h];
+        }
+    }
+
+
+#pragma mark - CONFLICTS:
+
     bool RevTree::hasConflict() const {
-        if (_revs.size() < 2) {
+        if (size() < 2) {
             CBFAssert(!_unknown);
             return false;
         } else if (_sorted) {
-            return _revs[1].isActive();
+            return get(1)->isActive();
         } else {
             unsigned nActive = 0;
             for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
@@ -252,6 +613,7 @@ namespace cbforest {
 
     std::vector<const Revision*> RevTree::currentRevisions() const {
         CBFAssert(!_unknown);
+        decodeAll();
         std::vector<const Revision*> cur;
         for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
             if (rev->isLeaf())
@@ -294,6 +656,28 @@ namespace cbforest {
         return alloc_slice(); // VersionedDocument overrides this
     }
 
+    void RevTree::setBodyExternal(const Revision* rev, bool external) {
+        auto mutableRev = const_cast<Revision*>(rev);
+        _spliceable = false;
+        if (external) {
+            mutableRev->body = slice::null;
+            mutableRev->oldBodyOffset = 0;
+            mutableRev->addFlag(Revision::kExternalBody);
+        } else {
+            mutableRev->clearFlag(Revision::kExternalBody);
+        }
+        _changed = true;
+    }
+
+    void RevTree::setBody(const Revision* rev, slice body) {
+        auto mutableRev = const_cast<Revision*>(rev);
+        _spliceable = false;
+        mutableRev->body = _insertedData.copy(body);
+        mutableRev->oldBodyOffset = 0;
+        mutableRev->clearFlag(Revision::kExternalBody);
+        _changed = true;
+    }
+
     bool RevTree::confirmLeaf(Revision* testRev) {
         int index = testRev->index();
         for (auto rev = _revs.begin(); rev != _revs.end(); ++rev)
@@ -306,6 +690,29 @@ namespace cbforest {
 
 #pragma mark - INSERTION:
 
+    slice SliceArena::copy(slice s) {
+        if (s.size == 0)
+            return s;       // nothing to copy, and the buffer is never dereferenced
+        if (s.size > (size_t)(_end - _next) || !_next) {
+            uint8_t* chunk;
+            if (s.size > kChunkSize / 4) {
+                // Big slices get their own chunk, so the current one keeps being filled:
+                chunk = new uint8_t[s.size];
+                _chunks.emplace_back(chunk);
+                ::memcpy(chunk, s.buf, s.size);
+                return slice(chunk, s.size);
+            }
+            chunk = new uint8_t[kChunkSize];
+            _chunks.emplace_back(chunk);
+            _next = chunk;
+            _end = chunk + kChunkSize;
+        }
+        slice result(_next, s.size);
+        ::memcpy(_next, s.buf, s.size);
+        _next += s.size;
+        return result;
+    }
+
     // Lowest-level insert method. Does no sanity checking, always inserts.
     const Revision* RevTree::_insert(revid unownedRevID,
                                      slice body,
@@ -314,11 +721,10 @@ namespace cbforest {
                                      bool hasAttachments)
     {
         CBFAssert(!_unknown);
+        decodeAll();
         // Allocate copies of the revID and data so they'll stay around:
-        _insertedData.push_back(alloc_slice(unownedRevID));
-        revid revID = revid(_insertedData.back());
-        _insertedData.push_back(alloc_slice(body));
-        body = _insertedData.back();
+        revid revID = revid(_insertedData.copy(unownedRevID));
+        body = _insertedData.copy(body);
 
         Revision newRev;
         newRev.owner = this;
@@ -332,6 +738,9 @@ namespace cbforest {
         if (hasAttachments)
             newRev.addFlag(Revision::kHasAttachments);
 
+        if (_changed || !parentRev || parentRev != &_revs[0])
+            _spliceable = false;        // see encodeSpliced()
+
         newRev.parentIndex = Revision::kNoParent;
         if (parentRev) {
             ptrdiff_t parentIndex = parentRev->index();
@@ -339,7 +748,21 @@ namespace cbforest {
             ((Revision*)parentRev)->clearFlag(Revision::kLeaf);
         }
 
+        if (_handleIndex.empty()) {
+            newRev.handle = (uint16_t)_revs.size();
+        } else {
+            CBFAssert(_handleIndex.size() < Revision::kNoParent);
+            newRev.handle = (uint16_t)_handleIndex.size();
+            _handleIndex.push_back((uint16_t)_revs.size());
+        }
+
         _revs.push_back(newRev);
+        if (!_revIndex.empty()) {
+            if (2 * _revs.size() > _revIndex.size())
+                buildRevIndex();    // grow the table
+            else
+                addToRevIndex((unsigned)_revs.size() - 1);
+        }
 
         _changed = true;
         if (_revs.size() > 1)
@@ -372,7 +795,7 @@ namespace cbforest {
             }
             parentGen = parent->revID.generation();
         } else {
-            if (!allowConflict && _revs.size() > 0) {
+            if (!allowConflict && size() > 0) {
                 httpStatus = 409;
                 return NULL;
             }
@@ -406,8 +829,11 @@ namespace cbforest {
     }
 
     int RevTree::insertHistory(const std::vector<revidBuffer> history, slice data,
-                               bool deleted, bool hasAttachments) {
+                               bool deleted, bool hasAttachments, RevHandle *outLeaf) {
         CBFAssert(history.size() > 0);
+        // Make room for the whole history at once, rather than growing _revs one rev at a time:
+        decodeAll();
+        _revs.reserve(_revs.size() + history.size());
         // Find the common ancestor, if any. Along the way, preflight revision IDs:
         int i;
         unsigned lastGen = 0;
@@ -429,14 +855,17 @@ namespace cbforest {
             // Insert all the new revisions in chronological order:
             while (--i > 0)
                 parent = _insert(history[i], slice(), parent, false, false);
-            _insert(history[0], data, parent, deleted, hasAttachments);
+            parent = _insert(history[0], data, parent, deleted, hasAttachments);
         }
+        if (outLeaf)
+            *outLeaf = handleOf(parent);
         return commonAncestorIndex;
     }
 
     unsigned RevTree::prune(unsigned maxDepth) {
-        if (maxDepth == 0 || _revs.size() <= maxDepth)
+        if (maxDepth == 0 || size() <= maxDepth)
             return 0;
+        decodeAll();
 
         // First find all the leaves, and walk from each one down to its root:
         int numPruned = 0;
@@ -448,7 +877,7 @@ namespace cbforest {
                 for (Revision* anc = rev; anc; anc = (Revision*)anc->parent()) {
                     if (++depth > maxDepth) {
                         // Mark revs that are too far away:
-                        anc->revID.size = 0;
+                        markForRemoval(anc);
                         numPruned++;
                     }
                 }
@@ -463,12 +892,14 @@ namespace cbforest {
 
     int RevTree::purge(revid leafID) {
         int nPurged = 0;
+        decodeAll();
+        _spliceable = false;
         Revision* rev = (Revision*)get(leafID);
         if (!rev || !rev->isLeaf())
             return 0;
         do {
             nPurged++;
-            rev->revID.size = 0;                    // mark for purge
+            markForRemoval(rev);
             const Revision* parent = (Revision*)rev->parent();
             rev->parentIndex = Revision::kNoParent; // unlink from parent
             rev = (Revision*)parent;
@@ -477,6 +908,13 @@ namespace cbforest {
         return nPurged;
     }
 
+    // Marks a rev to be removed by compact().
+    void RevTree::markForRemoval(Revision *rev) {
+        if (rev->revID.size > 0 && (rev->flags & Revision::kExternalBody))
+            removedExternalBody(rev);
+        rev->revID.size = 0;
+    }
+
     void RevTree::compact() {
         // Create a mapping from current to new rev indexes (after removing pruned/purged revs)
 		std::vector<uint16_t> map(_revs.size());
@@ -501,6 +939,9 @@ namespace cbforest {
             }
         }
         _revs.resize(dst - &_revs[0]);
+        remapHandles(map);
+        if (!_revIndex.empty())
+            buildRevIndex();
         _changed = true;
     }
 
@@ -522,6 +963,7 @@ namespace cbforest {
     void RevTree::sort() {
         if (_sorted)
             return;
+        decodeAll();
 
         // oldParents maps rev index to the original parentIndex, before the sort.
         // At the same time we change parentIndex[i] to i, so we can track what the sort did.
@@ -541,6 +983,13 @@ namespace cbforest {
             oldToNew[oldIndex] = i;
         }
 
+        // The rev index stores rev indexes too, so remap them the same way:
+        for (auto slot = _revIndex.begin(); slot != _revIndex.end(); ++slot) {
+            if (*slot != Revision::kNoParent)
+                *slot = oldToNew[*slot];
+        }
+        remapHandles(oldToNew);
+
         // Now fix up the parentIndex values by running them through oldToNew:
         for (unsigned i = 0; i < _revs.size(); ++i) {
             uint16_t oldIndex = _revs[i].parentIndex;
@@ -560,6 +1009,7 @@ namespace cbforest {
     }
 
     void RevTree::dump(std::ostream& out) {
+        decodeAll();
         int i = 0;
         for (auto rev = _revs.begin(); rev != _revs.end(); ++rev) {
             out << "\t" << (++i) << ": ";
@@ -19,6 +19,7 @@
 #include "slice.hh"
 #include "RevID.hh"
 #include "Database.hh"
+#include <memory>
 #include <vector>
 
 
@@ -27,6 +28,22 @@ namespace cbforest {
     class RevTree;
     class RawRevision;
 
+    /** A bump allocator that copies slices into large chunks, which are freed all at once when
+        the arena is destroyed. RevTree uses it for the revIDs and bodies of inserted revisions,
+        instead of a separate heap block (and refcount) per slice. */
+    class SliceArena {
+    public:
+        SliceArena() { }
+        slice copy(slice);
+    private:
+        static const size_t kChunkSize = 4096;
+        SliceArena(const SliceArena&) = delete;
+
+        std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+        uint8_t* _next {NULL};          // Next free byte in the current chunk
+        uint8_t* _end {NULL};           // End of the current chunk
+    };
+
     /** In-memory representation of a single revision's metadata. */
     class Revision {
     public:
@@ -55,7 +72,8 @@ namespace cbforest {
             kDeleted        = 0x01, /**< Is this revision a deletion/tombstone? */
             kLeaf           = 0x02, /**< Is this revision a leaf (no children?) */
             kNew            = 0x04, /**< Has this rev been inserted since decoding? */
-            kHasAttachments = 0x08  /**< Does this rev's body contain attachments? */
+            kHasAttachments = 0x08, /**< Does this rev's body contain attachments? */
+            kExternalBody   = 0x10  /**< Is the body stored outside the tree? (VersionedDocument) */
         };
         Flags flags;
 
@@ -65,10 +83,19 @@ namespace cbforest {
         slice       body;           /**< Revision body (JSON), or empty if not stored in this tree*/
         uint64_t    oldBodyOffset;  /**< File offset of doc containing revision body, or else 0 */
         uint16_t    parentIndex;    /**< Index in tree's rev[] array of parent revision, if any */
+        uint16_t    handle;         /**< Stable ID; see RevTree::RevHandle */
+
+        struct DeltaState {         // Running state of the v2 encoder/decoder
+            unsigned index;
+            uint64_t sequence;
+            uint64_t bodyOffset;
+        };
 
         void read(const RawRevision *src);
-        RawRevision* write(RawRevision* dst, uint64_t bodyOffset) const;
         size_t sizeToWrite() const;
+        RawRevision* write(RawRevision* dst, uint64_t bodyOffset) const;
+        void read(slice &src, DeltaState&);
+        size_t write(uint8_t* &dst, DeltaState&) const;
         void addFlag(Flags f)      {flags = (Flags)(flags | f);}
         void clearFlag(Flags f)    {flags = (Flags)(flags & ~f);}
 #if DEBUG
@@ -79,9 +106,21 @@ namespace cbforest {
     };
 
 
-    /** A serializable tree of Revisions. */
+    /** A serializable tree of Revisions.
+        Decoding is lazy: Revisions are only parsed from the encoded tree as they're accessed, in
+        index (priority) order. So reading just the current revision doesn't decode the rest. */
     class RevTree {
     public:
+        /** A stable reference to a Revision. Unlike a Revision pointer or array index, a handle
+            stays valid when revisions are inserted or the tree is sorted or pruned; once its
+            revision has been removed it resolves to NULL. Decoding a new tree invalidates it. */
+        struct RevHandle {
+            RevHandle()                     :id(UINT16_MAX) { }
+            explicit RevHandle(uint16_t i)  :id(i) { }
+            explicit operator bool() const  {return id != UINT16_MAX;}
+            uint16_t id;
+        };
+
         RevTree() { }
         RevTree(slice raw_tree, sequence seq, uint64_t docOffset);
         virtual ~RevTree() { }
@@ -90,18 +129,30 @@ namespace cbforest {
 
         alloc_slice encode();
 
-        size_t size() const                             {return _revs.size();}
+        /** Makes encode() write the compact v2 format instead of the legacy v1 format. Both are
+            always readable, but versions of CBForest before v2 can't read v2 trees, so this is
+            off by default; once a tree has been saved as v2 there's no going back.
+            Saving a v2 tree is also faster: when the only change is a new current revision,
+            encode() copies most of the previous encoding instead of re-encoding every rev. */
+        void setEncodeV2(bool v2)                       {_encodeV2 = v2;}
+
+        size_t size() const                             {return _revs.size() + _unreadCount;}
+        /** The number of revisions decoded so far (see the class comment.) */
+        size_t decodedCount() const                     {return _revs.size();}
         const Revision* get(unsigned index) const;
         const Revision* get(revid) const;
         const Revision* operator[](unsigned index) const {return get(index);}
         const Revision* operator[](revid revID) const    {return get(revID);}
         const Revision* getBySequence(sequence) const;
 
+        RevHandle handleOf(const Revision*) const;
+        const Revision* get(RevHandle) const;
+
 #ifdef __OBJC__
         const Revision* get(NSString* revID) const;
 #endif
 
-        const std::vector<Revision>& allRevisions() const    {return _revs;}
+        const std::vector<Revision>& allRevisions() const    {decodeAll(); return _revs;}
         const Revision* currentRevision();
         std::vector<const Revision*> currentRevisions() const;
         bool hasConflict() const;
@@ -116,9 +167,13 @@ namespace cbforest {
                                const Revision* parent,
                                bool allowConflict,
                                int &httpStatus);
+        /** Adds a revision and its ancestry, history[0] being the new rev. Returns the index in
+            `history` of the common ancestor (the first rev already in the tree), or -1 if the
+            history is invalid. If outLeaf is non-NULL it's set to the handle of history[0]. */
         int insertHistory(const std::vector<revidBuffer> history,
                           slice body,
-                          bool deleted, bool hasAttachments);
+                          bool deleted, bool hasAttachments,
+                          RevHandle *outLeaf =NULL);
 
         unsigned prune(unsigned maxDepth);
 
@@ -134,22 +189,48 @@ namespace cbforest {
     protected:
         virtual bool isBodyOfRevisionAvailable(const Revision*, uint64_t atOffset) const;
         virtual alloc_slice readBodyOfRevision(const Revision*, uint64_t atOffset) const;
+        /** Called when a rev with the kExternalBody flag is pruned or purged from the tree. */
+        virtual void removedExternalBody(const Revision*)   { }
 #if DEBUG
         virtual void dump(std::ostream&);
 #endif
 
+        /** Drops a rev's inline body and marks it as stored elsewhere (or clears that mark.) */
+        void setBodyExternal(const Revision*, bool external);
+        /** Replaces a rev's body with an inline copy of `body`, clearing kExternalBody. */
+        void setBody(const Revision*, slice body);
+
     private:
         friend class Revision;
         const Revision* _insert(revid, slice body, const Revision *parentRev,
                                 bool deleted, bool hasAttachments);
+        void decodeRevs(size_t count) const;
+        void decodeAll() const                          {if (_unreadCount) decodeRevs(SIZE_MAX);}
+        void buildRevIndex() const;
+        void addToRevIndex(unsigned revIndex);
+        const Revision* findInRevIndex(revid) const;
+        void remapHandles(const std::vector<uint16_t> &oldToNew);
+        alloc_slice encodeV1() const;
+        alloc_slice encodeSpliced();
         bool confirmLeaf(Revision* testRev);
+        void markForRemoval(Revision*);
         void compact();
         RevTree(const RevTree&) = delete;
 
         uint64_t    _bodyOffset {0};     // File offset of body this tree was read from
         bool        _sorted {true};         // Are the revs currently sorted?
         std::vector<Revision> _revs;
-        std::vector<alloc_slice> _insertedData;
+        SliceArena  _insertedData;                  // Owns revIDs & bodies of inserted revs
+        slice       _unread;                        // Encoded revs not yet decoded into _revs
+        bool        _legacyFormat {false};          // Is _unread in the old (v1) encoding?
+        Revision::DeltaState _unreadState {};       // Decoder state for _unread (v2 only)
+        size_t      _unreadCount {0};               // Number of encoded revs not yet decoded
+        sequence    _unreadSequence {0};            // Default sequence for undecoded revs
+        std::vector<uint16_t> _revIndex;            // Hash table of _revs indexes, by revID
+        std::vector<uint16_t> _handleIndex;         // Maps RevHandle ids to _revs indexes
+        slice       _encoded;                       // The v2 encoded tree that was decoded
+        bool        _spliceable {false};            // Can encodeSpliced() reuse _encoded?
+        bool        _encodeV2 {false};              // Does encode() write the v2 format?
     protected:
         bool _changed {false};
         bool _unknown {false};
@@ -14,6 +14,7 @@
 //  and limitations under the License.
 
 #include "VersionedDocument.hh"
+#include "DocEnumerator.hh"
 #include "Error.hh"
 #include "varint.hh"
 #include <ostream>
@@ -28,6 +29,17 @@ namespace cbforest {
         bytes   type
     */
 
+    // Key of a revision body in a body store: varint docID length, docID, then compressed revID.
+    // (A null revID gives the prefix shared by all of the doc's bodies.)
+    static alloc_slice bodyKey(slice docID, slice revID) {
+        alloc_slice key(SizeOfVarInt(docID.size) + docID.size + revID.size);
+        slice out = key;
+        WriteUVarInt(&out, docID.size);
+        out.writeFrom(docID);
+        out.writeFrom(revID);
+        return key;
+    }
+
     VersionedDocument::VersionedDocument(KeyStore& db, slice docID)
     :_db(db), _doc(docID)
     {
@@ -122,11 +134,65 @@ namespace cbforest {
         CBFAssert(meta.size == 0);
     }
 
+#pragma mark - BODY CACHE:
+
+    std::string RevisionBodyCache::keyFor(uint64_t offset, revid revID) {
+        std::string key((const char*)&offset, sizeof(offset));
+        key.append((const char*)revID.buf, revID.size);
+        return key;
+    }
+
+    alloc_slice RevisionBodyCache::get(uint64_t offset, revid revID) {
+        std::string key = keyFor(offset, revID);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto i = _entries.find(key);
+        if (i == _entries.end()) {
+            ++_misses;
+            return alloc_slice();
+        }
+        ++_hits;
+        _lru.splice(_lru.begin(), _lru, i->second);     // move to front
+        return i->second->second;
+    }
+
+    void RevisionBodyCache::put(uint64_t offset, revid revID, alloc_slice body) {
+        if (body.size > _capacity)
+            return;
+        std::string key = keyFor(offset, revID);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_entries.find(key) != _entries.end())
+            return;
+        _lru.emplace_front(key, body);
+        _entries[key] = _lru.begin();
+        _size += body.size;
+        while (_size > _capacity) {
+            auto &oldest = _lru.back();
+            _size -= oldest.second.size;
+            _entries.erase(oldest.first);
+            _lru.pop_back();
+        }
+    }
+
+    void RevisionBodyCache::clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _lru.clear();
+        _entries.clear();
+        _size = 0;
+    }
+
+
+#pragma mark - REVISION BODIES:
+
     bool VersionedDocument::isBodyOfRevisionAvailable(const Revision* rev, uint64_t atOffset) const {
         if (RevTree::isBodyOfRevisionAvailable(rev, atOffset))
             return true;
+        if (rev->flags & Revision::kExternalBody)
+            return _bodyStore && _bodyStore->get(bodyKey(docID(), rev->revID),
+                                                 KeyStore::kMetaOnly).exists();
         if (atOffset == 0 || atOffset >= _doc.offset())
             return false;
+        if (_bodyCache)
+            return readBodyOfRevision(rev, atOffset).buf != NULL;  // reads it into the cache
         VersionedDocument oldVersDoc(_db, _db.getByOffset(atOffset, rev->sequence));
         if (!oldVersDoc.exists() || oldVersDoc.sequence() != rev->sequence)
             return false;
@@ -137,21 +203,88 @@ namespace cbforest {
     alloc_slice VersionedDocument::readBodyOfRevision(const Revision* rev, uint64_t atOffset) const {
         if (RevTree::isBodyOfRevisionAvailable(rev, atOffset))
             return RevTree::readBodyOfRevision(rev, atOffset);
+        if (rev->flags & Revision::kExternalBody) {
+            if (!_bodyStore)
+                return alloc_slice();
+            Document bodyDoc = _bodyStore->get(bodyKey(docID(), rev->revID));
+            return bodyDoc.exists() ? alloc_slice(bodyDoc.body()) : alloc_slice();
+        }
         if (atOffset == 0 || atOffset >= _doc.offset())
             return alloc_slice();
+        if (_bodyCache) {
+            alloc_slice body = _bodyCache->get(atOffset, rev->revID);
+            if (body.buf)
+                return body;
+        }
         VersionedDocument oldVersDoc(_db, _db.getByOffsetNoErrors(atOffset, rev->sequence));
         if (!oldVersDoc.exists() || oldVersDoc.sequence() != rev->sequence)
             return alloc_slice();
         const Revision* oldRev = oldVersDoc.get(rev->revID);
         if (!oldRev)
             return alloc_slice();
-        return alloc_slice(oldRev->inlineBody());
+        alloc_slice body(oldRev->inlineBody());
+        if (_bodyCache && body.buf)
+            _bodyCache->put(atOffset, rev->revID, body);
+        return body;
+    }
+
+    void VersionedDocument::removedExternalBody(const Revision* rev) {
+        _removedBodyKeys.push_back(bodyKey(docID(), rev->revID));
+    }
+
+    // Moves the bodies of non-current leaf revs out to _bodyStore, and brings back the body of
+    // the current rev if it was out there. Deletes the stored bodies of revs that were pruned or
+    // purged. (A rev that's no longer a leaf keeps its stored body until then, just as an inline
+    // ancestor's body stays readable from the doc's previous version until compaction.)
+    void VersionedDocument::moveConflictBodies(Transaction& transaction) {
+        KeyStoreWriter bodies = transaction(_bodyStore);
+        for (auto key = _removedBodyKeys.begin(); key != _removedBodyKeys.end(); ++key)
+            bodies.del(*key);
+        _removedBodyKeys.clear();
+
+        const Revision *current = currentRevision();
+        auto &revs = allRevisions();
+        for (auto rev = revs.begin(); rev != revs.end(); ++rev) {
+            if (rev->flags & Revision::kExternalBody) {
+                if (&*rev == current) {
+                    alloc_slice key = bodyKey(docID(), rev->revID);
+                    Document bodyDoc = _bodyStore->get(key);
+                    if (bodyDoc.exists())
+                        setBody(&*rev, bodyDoc.body());
+                    else
+                        setBodyExternal(&*rev, false);
+                    bodies.del(key);
+                }
+            } else if (rev->isLeaf() && &*rev != current && rev->inlineBody().size > 0) {
+                bodies.set(bodyKey(docID(), rev->revID), rev->inlineBody());
+                setBodyExternal(&*rev, true);
+            }
+        }
+    }
+
+    void VersionedDocument::purgeBodies(KeyStore &bodyStore, Transaction& transaction,
+                                        slice docID)
+    {
+        alloc_slice prefix = bodyKey(docID, slice::null);
+        auto options = DocEnumerator::Options::kDefault;
+        options.contentOptions = KeyStore::kMetaOnly;
+        std::vector<alloc_slice> keys;
+        for (DocEnumerator e(bodyStore, prefix, slice::null, options); e.next(); ) {
+            if (!e.doc().key().hasPrefix(prefix))
+                break;
+            keys.push_back(alloc_slice(e.doc().key()));
+        }
+        KeyStoreWriter bodies = transaction(bodyStore);
+        for (auto key = keys.begin(); key != keys.end(); ++key)
+            bodies.del(*key);
     }
 
     void VersionedDocument::save(Transaction& transaction) {
         if (!_changed)
             return;
         updateMeta();
+        if (_bodyStore)
+            moveConflictBodies(transaction);
         if (currentRevision()) {
             // Don't call _doc.setBody() because it'll invalidate all the pointers from Revisions into
             // the existing body buffer.
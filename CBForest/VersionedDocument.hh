@@ -17,9 +17,46 @@
 #define __CBForest__VersionedDocument__
 #include "RevTree.hh"
 #include "Document.hh"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 namespace cbforest {
 
+    /** A bounded LRU cache of revision bodies that were read from earlier versions of documents,
+        keyed by (file offset, revID). One can be shared by all the VersionedDocuments of a
+        database (see VersionedDocument::setBodyCache), across threads. Since compaction moves
+        documents to new offsets, it must be cleared when the database compacts. */
+    class RevisionBodyCache {
+    public:
+        static const size_t kDefaultCapacity = 1024*1024;
+
+        explicit RevisionBodyCache(size_t capacity =kDefaultCapacity) :_capacity(capacity) { }
+
+        /** Returns the cached body, or a null slice if it's not cached. */
+        alloc_slice get(uint64_t offset, revid);
+        void put(uint64_t offset, revid, alloc_slice body);
+        void clear();
+
+        size_t capacity() const     {return _capacity;}     /**< Max total size of bodies */
+        uint64_t hits() const       {return _hits;}
+        uint64_t misses() const     {return _misses;}
+
+    private:
+        typedef std::pair<std::string, alloc_slice> entry;
+
+        static std::string keyFor(uint64_t offset, revid);
+
+        const size_t _capacity;
+        size_t _size {0};
+        std::list<entry> _lru;                  // most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> _entries;
+        std::atomic<uint64_t> _hits {0}, _misses {0};
+        std::mutex _mutex;
+    };
+
     /** Manages storage of a serialized RevTree in a Document. */
     class VersionedDocument : public RevTree {
     public:
@@ -60,9 +97,25 @@ namespace cbforest {
         slice docType() const       {return _docType;}
         void setDocType(slice type) {_docType = type;}
 
+        /** Sets a KeyStore to hold the bodies of conflicting (non-current leaf) revisions, so
+            the document's own record carries only the current revision's body. save() moves
+            such bodies into the store, keyed by docID and revID, and Revision::readBody() reads
+            them back from it. The same store has to be set on every VersionedDocument that
+            reads the document, or those bodies will appear to be unavailable. */
+        void setBodyStore(KeyStore *store)  {_bodyStore = store;}
+        KeyStore* bodyStore() const         {return _bodyStore;}
+
+        /** Sets a cache for the bodies that Revision::readBody() reads from earlier versions of
+            this document. */
+        void setBodyCache(RevisionBodyCache *cache) {_bodyCache = cache;}
+
         bool changed() const        {return _changed;}
         void save(Transaction& transaction);
 
+        /** Deletes all of a document's revision bodies from a body store (see setBodyStore).
+            Call this when purging a document by deleting it directly from its KeyStore. */
+        static void purgeBodies(KeyStore &bodyStore, Transaction&, slice docID);
+
         /** Gets the metadata of a document without having to instantiate a VersionedDocument */
         static bool readMeta(const Document&, Flags&, revid&, slice& docType);
 
@@ -74,12 +127,14 @@ namespace cbforest {
     protected:
         virtual bool isBodyOfRevisionAvailable(const Revision*, uint64_t atOffset) const;
         virtual alloc_slice readBodyOfRevision(const Revision*, uint64_t atOffset) const;
+        virtual void removedExternalBody(const Revision*);
 #if DEBUG
         virtual void dump(std::ostream&);
 #endif
 
     private:
         void decode();
+        void moveConflictBodies(Transaction&);
         VersionedDocument(const VersionedDocument&) = delete;
 
         KeyStore&   _db;
@@ -87,6 +142,9 @@ namespace cbforest {
         Flags       _flags;
         revid       _revID;
         alloc_slice _docType;
+        KeyStore*   _bodyStore {nullptr};
+        RevisionBodyCache* _bodyCache {nullptr};
+        std::vector<alloc_slice> _removedBodyKeys;  // body store keys to delete on save
     };
 }
 